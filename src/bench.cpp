@@ -0,0 +1,212 @@
+/*
+ * bench.cpp
+ *
+ *  Created on: 19.10.2026
+ */
+
+#include "config.h"
+#include "gettext.h"
+#define _(str) gettext(str)
+#include "mapi.h"
+#include <iostream>
+#include <locale>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <cstdlib>
+#include <chrono>
+#include <stdexcept>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/bind/bind.hpp>
+
+/*
+ * Измерение задержки поиска во время clear() большого mapi, скорости serialize/deserialize
+ * и чтения через find и get.
+ * Запуск: mapi_bench [число элементов] [число читателей]
+ */
+
+typedef mapi<std::string, int> bench_mapi;
+typedef std::chrono::steady_clock bench_clock;
+
+/*
+ * Функция читателя - ищет ключи в цикле и запоминает время каждого поиска в микросекундах
+ */
+void
+read_keys(bench_mapi& m, const std::vector<std::string>& keys,
+        volatile bool *work, std::vector<double> *latency,
+        boost::mutex *mutex)
+{
+    std::vector<double> local;
+    for (std::size_t i = 0; *work; ++i)
+    {
+        bench_clock::time_point start = bench_clock::now();
+        m.find(keys[i % keys.size()]);
+        local.push_back(
+                std::chrono::duration<double, std::micro>(
+                        bench_clock::now() - start).count());
+    }
+    boost::mutex::scoped_lock lock(*mutex);
+    latency->insert(latency->end(), local.begin(), local.end());
+}
+
+/*
+ * Один прогон: заполнение, запуск читателей, clear(), вывод времени очистки и задержек читателей
+ */
+void
+run(const char *name, std::size_t entries, std::size_t readers,
+        const boost::shared_ptr<mapi_reclaimer>& reclaimer)
+{
+    std::vector<std::string> keys;
+    std::map<std::string, int> data;
+    std::ostringstream ost;
+    for (std::size_t i = 0; i < entries; ++i)
+    {
+        ost << "key" << i;
+        keys.push_back(ost.str());
+        data[ost.str()] = int(i % 1000);
+        ost.str("");
+    }
+    bench_mapi m(data);
+    m.set_reclaimer(reclaimer);
+    volatile bool work = true;
+    std::vector<double> latency;
+    boost::mutex mutex;
+    boost::thread_group group;
+    for (std::size_t i = 0; i < readers; ++i)
+        group.create_thread(
+                boost::bind(read_keys, boost::ref(m), boost::cref(keys),
+                        &work, &latency, &mutex));
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    bench_clock::time_point start = bench_clock::now();
+    m.clear();
+    double cleared = std::chrono::duration<double, std::milli>(
+            bench_clock::now() - start).count();
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    work = false;
+    group.join_all();
+    if( reclaimer )
+        reclaimer->wait();
+    std::sort(latency.begin(), latency.end());
+    double max = latency.empty() ? 0 : latency.back();
+    double p999 = latency.empty() ? 0 :
+            latency[std::size_t(latency.size() * 0.999)];
+    std::cout << name << _(": clear ") << cleared << _(" ms, lookups ")
+            << latency.size() << _(", p99.9 ") << p999 << _(" us, max ")
+            << max << _(" us\n");
+}
+
+/*
+ * Функция читателя - count раз читает значения через get или find, число найденных записывается
+ * в *found. Исключение из потока не выбрасывается, проверка выполняется после join
+ */
+void
+lookup_keys(const bench_mapi& m, const std::vector<std::string>& keys,
+        std::size_t count, bool optimistic, std::size_t *found)
+{
+    for (std::size_t i = 0; i < count; ++i)
+        if( optimistic ? bool(m.get(keys[i % keys.size()])) :
+                m.find(keys[i % keys.size()]) != m.end() )
+            ++*found;
+}
+
+/*
+ * Скорость чтения значений в readers потоках через find (под блокировкой) и get (через шлюз)
+ */
+void
+run_get(std::size_t entries, std::size_t readers)
+{
+    std::vector<std::string> keys;
+    std::map<std::string, int> data;
+    std::ostringstream ost;
+    for (std::size_t i = 0; i < entries; ++i)
+    {
+        ost << "key" << i;
+        keys.push_back(ost.str());
+        data[ost.str()] = int(i % 1000);
+        ost.str("");
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937());
+    const bench_mapi m(data);
+    const std::size_t count = 1000000;
+    for (int optimistic = 0; optimistic < 2; ++optimistic)
+    {
+        std::vector<std::size_t> found(readers, 0);
+        bench_clock::time_point start = bench_clock::now();
+        boost::thread_group group;
+        for (std::size_t i = 0; i < readers; ++i)
+            group.create_thread(
+                    boost::bind(lookup_keys, boost::cref(m), boost::cref(keys),
+                            count, optimistic != 0, &found[i]));
+        group.join_all();
+        double seconds = std::chrono::duration<double>(
+                bench_clock::now() - start).count();
+        if( std::size_t(std::count(found.begin(), found.end(), count)) != readers )
+            throw std::logic_error(_("lookup failed"));
+        std::cout << (optimistic ? _("get: ") : _("find: "))
+                << count * readers / seconds / 1e6 << _(" Mops/s\n");
+    }
+}
+
+/*
+ * Скорость записи и чтения serialize/deserialize в памяти, МБ/с
+ */
+void
+run_serialize(std::size_t entries)
+{
+    std::map<std::string, int> data;
+    std::ostringstream ost;
+    for (std::size_t i = 0; i < entries; ++i)
+    {
+        ost << "key" << i;
+        data[ost.str()] = int(i % 1000);
+        ost.str("");
+    }
+    bench_mapi m(data);
+    std::stringstream stored;
+    bench_clock::time_point start = bench_clock::now();
+    m.serialize(stored);
+    double written = std::chrono::duration<double>(
+            bench_clock::now() - start).count();
+    double megabytes = stored.str().size() / 1048576.0;
+    bench_mapi loaded;
+    start = bench_clock::now();
+    loaded.deserialize(stored);
+    double read = std::chrono::duration<double>(
+            bench_clock::now() - start).count();
+    std::cout << _("serialize: ") << megabytes << _(" MB, write ")
+            << megabytes / written << _(" MB/s, read ") << megabytes / read
+            << _(" MB/s\n");
+}
+
+int
+main(int argc, char *argv[])
+try
+{
+    std::locale::global(std::locale(""));
+    bindtextdomain(PACKAGE, LOCALEDIR);
+    textdomain(PACKAGE);
+    std::size_t entries = argc > 1 ? std::strtoul(argv[1], 0, 10) : 1000000;
+    std::size_t readers = argc > 2 ? std::strtoul(argv[2], 0, 10) : 2;
+    if( entries == 0 || readers == 0 )
+        throw std::invalid_argument(_("entries and readers must be positive"));
+    run(_("inline"), entries, readers, boost::shared_ptr<mapi_reclaimer>());
+    run(_("reclaimer"), entries, readers,
+            boost::shared_ptr<mapi_reclaimer>(new mapi_reclaimer));
+    run_serialize(entries);
+    run_get(entries, readers);
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cerr << _("An exception occurred: ") << e.what() << std::endl;
+    return EXIT_FAILURE;
+}
+catch (...)
+{
+    std::cerr << _("An unknown exception\n");
+    return EXIT_FAILURE;
+}
@@ -9,6 +9,9 @@
 #include "gettext.h"
 #define _(str) gettext(str)
 #include "mapi.h"
+#include "mapi_shm.h"
+#include "mapi_reload.h"
+#include "mapi_feed.h"
 #include <iostream>
 #include <locale>
 #include <string>
@@ -18,6 +21,45 @@
 #include <cstdlib>
 #include <stdexcept>
 #include <boost/thread/thread.hpp>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*
+ * Перечисление для тестирования плотного индекса
+ */
+enum state
+{
+    idle, running, stopped
+};
+template<>
+    struct mapi_dense_value<state>
+    {
+        static const bool dense = true;
+        static const std::size_t bound = 3;
+    };
+
+/*
+ * Функция для тестирования, выполняется в отдельном процессе - открывает сегмент shm_mapi, созданный
+ * родителем, и проверяет поиск по ключу и по значению. Возвращает код завершения процесса
+ */
+int
+attach_shm(const char *name)
+try
+{
+    shm_mapi<std::string, int> worker(boost::interprocess::open_only, name);
+    int value = 0;
+    std::vector<std::string> vkeys;
+    worker.findv(2, vkeys);
+    if( worker.size() != 3 || !worker.validate()
+            || !worker.find("test1", value) || value != 1
+            || worker.find("test9", value) || vkeys.size() != 2 )
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+catch (...)
+{
+    return EXIT_FAILURE;
+}
 
 /*
  * Функция для тестирования - изменяет mapi большое число раз
@@ -78,6 +120,135 @@ catch (...)
     exit(EXIT_FAILURE);
 }
 
+/*
+ * Функция для тестирования - ищет ключ test1, который есть в mapi до и после каждой перезагрузки,
+ * и ключ absent, которого нет
+ */
+void
+probe(mapi<std::string, int>& m, volatile bool *work, volatile int *missing)
+try
+{
+    while (*work)
+    {
+        if( m.find("test1") == m.end() || !m.get("test1") )
+            ++*missing;
+        if( m.find("absent") != m.end() )
+            ++*missing;
+        if( m.findv(1).empty() )
+            ++*missing;
+    }
+}
+catch (const std::exception& e)
+{
+    std::cerr << _("An exception occurred: ") << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+}
+catch (...)
+{
+    std::cerr << _("An unknown exception\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Функция для тестирования - читает текущую версию mapi_publisher, пока идет перезагрузка
+ */
+void
+read_published(mapi_publisher<std::string, int>& p, volatile bool *work,
+        volatile int *count)
+try
+{
+    while (*work)
+    {
+        mapi_publisher<std::string, int>::pointer m = p.current();
+        assert(m->size() == 1000);
+        assert(m->find("test0") != m->end());
+        assert(m->findv(m->find("test0")->second).size() == 1000);
+        ++*count;
+    }
+}
+catch (const std::exception& e)
+{
+    std::cerr << _("An exception occurred: ") << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+}
+catch (...)
+{
+    std::cerr << _("An unknown exception\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Функция для тестирования - n раз ищет существующий ключ key0 и n раз отсутствующий ключ
+ */
+void
+lookup_n(const mapi<std::string, int>& m, int n)
+{
+    for (int j = 0; j < n; ++j)
+    {
+        assert(m.get("key0"));
+        assert(!m.get("absent"));
+    }
+}
+
+/*
+ * Функция для тестирования - вставляет и удаляет ключи test0 - test99, пока идет обход
+ */
+void
+churn(mapi<std::string, int>& m, volatile bool *work)
+{
+    std::ostringstream ost;
+    for (int j = 0; *work; j = (j + 1) % 100)
+    {
+        ost << "test" << j;
+        if( !m.insert(std::make_pair(ost.str(), -1)).second )
+            m.erase(ost.str());
+        ost.str("");
+    }
+}
+
+/*
+ * Функтор для тестирования обхода - считает элементы с неотрицательными значениями и их сумму
+ */
+struct sum_values
+{
+    sum_values() :
+            count(0), sum(0)
+    {
+    }
+    void
+    operator()(const std::string&, int v)
+    {
+        if( v >= 0 )
+        {
+            ++count;
+            sum += v;
+        }
+    }
+    std::size_t count;
+    long long sum;
+};
+
+/*
+ * Функтор для for_each, обращающийся к обходимому mapi: считает элементы с неотрицательными
+ * значениями, которые get возвращает без изменений
+ */
+struct lookup_values
+{
+    explicit
+    lookup_values(const mapi<std::string, int>& m) :
+            m(&m), found(0)
+    {
+    }
+    void
+    operator()(const std::string& k, int v)
+    {
+        if( v >= 0 && m->get(k) == v )
+            ++found;
+    }
+    const mapi<std::string, int>* m;
+    std::size_t found;
+};
+
 /*
  * Тестирование класса mapi
  */
@@ -336,6 +507,864 @@ try
     assert(a.validate());
     assert(a.empty());
     std::cout << _("tested ") << count << _(" times OK\n");
+    std::cout << _("Test 16 Dense index: ");
+    mapi<std::string, state> f;
+    f["test1"] = running;
+    f["test2"] = running;
+    f["test3"] = stopped;
+    f["test4"];
+    assert(f.validate());
+    assert(f.countv(idle) == 1);
+    assert(f.countv(running) == 2);
+    assert(f.countv(stopped) == 1);
+    assert(f.countv(static_cast<state>(7)) == 0);
+    assert(f.findv(static_cast<state>(7)).empty());
+    std::vector<mapi<std::string, state>::iterator> vfit = f.findv(running);
+    assert(vfit.size() == 2);
+    assert(vfit[0]->second == running);
+    assert(vfit[1]->second == running);
+    f.erase("test1");
+    f["test4"] = running;
+    f.find("test3")->second = idle;
+    assert(f.validate());
+    assert(f.countv(idle) == 1);
+    assert(f.countv(running) == 2);
+    assert(f.countv(stopped) == 0);
+    vfit = f.findv(idle);
+    assert(vfit.size() == 1);
+    assert(vfit[0]->first == "test3");
+    bool thrown = false;
+    try
+    {
+        f.insert(std::make_pair("test5", static_cast<state>(3)));
+    }
+    catch (const std::out_of_range&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    assert(f.find("test5") == f.end());
+    assert(f.size() == 3);
+    assert(f.validate());
+    // присваивание с недопустимым значением не меняет содержимое
+    std::map<std::string, state> bad;
+    bad["test0"] = idle;
+    bad["test9"] = static_cast<state>(3);
+    f.enable_filter(10, 3);
+    thrown = false;
+    try
+    {
+        f = bad;
+    }
+    catch (const std::out_of_range&)
+    {
+        thrown = true;
+    }
+    assert(thrown && f.size() == 3 && f.find("test0") == f.end());
+    assert(f.find("test3") != f.end() && f.findv(idle).size() == 1);
+    assert(f.validate());
+    f.erase(f.begin(), f.end());
+    assert(f.empty());
+    assert(f.validate());
+    assert(f.countv(running) == 0);
+    std::cout << _("OK\n");
+    std::cout << _("Test 17 Bitmap index: ");
+    boost::shared_ptr<mapi_key_space<std::string> > space(
+            new mapi_key_space<std::string>);
+    mapi<std::string, int> g, h;
+    std::ostringstream ostg;
+    for (int j = 0; j < 10000; ++j)
+    {
+        ostg << "test" << j;
+        g.insert(std::make_pair(ostg.str(), j % 3));
+        if( j % 2 == 0 )
+            h.insert(std::make_pair(ostg.str(), j % 5));
+        ostg.str("");
+    }
+    std::vector<int> values;
+    assert(g.findv_any(values.begin(), values.end()).empty());
+    values.push_back(0);
+    values.push_back(2);
+    values.push_back(2);
+    values.push_back(7);
+    assert(g.countv_any(values.begin(), values.end()) == 6667);
+    assert(g.findv_any(values.begin(), values.end()).size() == 6667);
+    g.enable_bitmap(space);
+    h.enable_bitmap(space);
+    assert(g.validate());
+    assert(h.validate());
+    std::vector<mapi<std::string, int>::iterator> vgit = g.findv_any(
+            values.begin(), values.end());
+    assert(vgit.size() == 6667);
+    for (std::size_t j = 0; j < vgit.size(); ++j)
+        assert(vgit[j]->second == 0 || vgit[j]->second == 2);
+    // ключи, у которых в g значение 0, а в h значение 1: j % 3 == 0, j % 5 == 1, j четное
+    mapi_bitmap both = g.bitmap(0) & h.bitmap(1);
+    assert(both.cardinality() == 334);
+    std::vector<const std::string*> keys;
+    space->keys(both, keys);
+    assert(keys.size() == 334);
+    for (std::size_t j = 0; j < keys.size(); ++j)
+    {
+        int n = atoi(keys[j]->c_str() + 4);
+        assert(n % 3 == 0 && n % 5 == 1 && n % 2 == 0);
+    }
+    assert((g.bitmap(1) | h.bitmap(1)).cardinality() == 3333 + 1000 - 333);
+    g.erase("test0");
+    g["test3"] = 1;
+    g["test30000"] = 0;
+    assert(g.validate());
+    assert(g.bitmap(0).cardinality() == 3333);
+    assert(g.bitmap(0).contains(space->insert("test30000")));
+    assert(!g.bitmap(0).contains(space->insert("test3")));
+    g.erase(g.begin(), g.end());
+    assert(g.validate());
+    assert(g.bitmap(0).empty());
+    std::cout << _("OK\n");
+    std::cout << _("Test 18 Batch search: ");
+    g.clear();
+    for (int j = 0; j < 1000; ++j)
+    {
+        ostg << "test" << j;
+        g.insert(std::make_pair(ostg.str(), j % 7));
+        ostg.str("");
+    }
+    std::vector<std::string> probes;
+    probes.push_back("test500");
+    probes.push_back("test1");
+    probes.push_back("missing");
+    probes.push_back("test999");
+    probes.push_back("test10");
+    probes.push_back("test1");
+    std::vector<mapi<std::string, int>::iterator> vmany;
+    g.find_many(probes, vmany);
+    assert(vmany.size() == probes.size());
+    for (std::size_t j = 0; j < probes.size(); ++j)
+        assert(vmany[j] == g.find(probes[j]));
+    assert(vmany[2] == g.end());
+    std::vector<int> vprobes;
+    vprobes.push_back(6);
+    vprobes.push_back(0);
+    vprobes.push_back(42);
+    vprobes.push_back(6);
+    std::vector<std::vector<mapi<std::string, int>::const_iterator> > vvmany;
+    const mapi<std::string, int>& cg = g;
+    cg.findv_many(vprobes, vvmany);
+    assert(vvmany.size() == vprobes.size());
+    for (std::size_t j = 0; j < vprobes.size(); ++j)
+    {
+        assert(vvmany[j].size() == cg.countv(vprobes[j]));
+        for (std::size_t k = 0; k < vvmany[j].size(); ++k)
+            assert(vvmany[j][k]->second == vprobes[j]);
+    }
+    assert(vvmany[0].size() == 142);
+    assert(vvmany[2].empty());
+    std::vector<std::vector<mapi<std::string, state>::iterator> > vfmany;
+    std::vector<state> sprobes(1, running);
+    f["test1"] = running;
+    f.findv_many(sprobes, vfmany);
+    assert(vfmany.size() == 1 && vfmany[0].size() == 1);
+    assert(vfmany[0][0]->first == "test1");
+    std::cout << _("OK\n");
+    std::cout << _("Test 19 Bloom filter: ");
+    g.enable_filter(2000, 16);
+    assert(g.validate());
+    for (int j = 0; j < 1000; ++j)
+    {
+        ostg << "test" << j;
+        assert(g.find(ostg.str()) != g.end());
+        ostg.str("");
+        ostg << "miss" << j;
+        assert(g.find(ostg.str()) == g.end());
+        ostg.str("");
+    }
+    mapi_filter_stats kstats = g.key_filter_stats();
+    assert(kstats.lookups >= 1000);
+    assert(kstats.lookups - kstats.false_positives == 1000);
+    assert(kstats.false_positives < 100);
+    assert(kstats.fpr > 0 && kstats.fpr < 0.1);
+    for (int j = 0; j < 7; ++j)
+        assert(g.findv(j).size() == g.countv(j));
+    assert(g.findv(7).empty());
+    g["test1"] = 100;
+    assert(g.findv(100).size() == 1);
+    assert(g.erase("test1") == 1);
+    assert(g.find("test1") == g.end());
+    assert(g.findv(100).empty());
+    g.insert(std::make_pair("test1", 1));
+    assert(g.find("test1") != g.end());
+    assert(g.validate());
+    g.clear();
+    assert(g.find("test2") == g.end());
+    assert(g.findv(2).empty());
+    g["test2"] = 2;
+    assert(g.find("test2") != g.end());
+    assert(g.findv(2).size() == 1);
+    assert(g.value_filter_stats().lookups > 0);
+    std::map<std::string, int> reload;
+    for (int j = 0; j < 2000; ++j)
+    {
+        ostg << "test" << j;
+        reload[ostg.str()] = j % 10;
+        ostg.str("");
+    }
+    mapi<std::string, int> reloaded(reload);
+    reloaded.enable_filter(2000, 10);
+    std::stringstream reload_stream;
+    reloaded.serialize(reload_stream);
+    // absent отсекается фильтром, поэтому ложных срабатываний быть не должно, в том числе
+    // для поисков, обошедших фильтр во время перезагрузки
+    kstats = reloaded.key_filter_stats();
+    assert(reloaded.find("absent") == reloaded.end());
+    bool rejected = reloaded.key_filter_stats().lookups == kstats.lookups;
+    volatile bool probing = true;
+    volatile int missing = 0;
+    boost::thread prober(probe, boost::ref(reloaded), &probing, &missing);
+    for (int j = 0; j < 1000; ++j)
+    {
+        reloaded = reload;
+        reload_stream.clear();
+        reload_stream.seekg(0);
+        reloaded.deserialize(reload_stream);
+    }
+    probing = false;
+    prober.join();
+    assert(missing == 0 && reloaded.validate());
+    assert(!rejected || reloaded.key_filter_stats().false_positives == 0);
+    std::cout << _("OK\n");
+    std::cout << _("Test 20 Shared memory: ");
+    typedef shm_mapi<std::string, int> shm_mapi_test;
+    shm_mapi_test::remove("mapi_test");
+    {
+        shm_mapi_test loader(boost::interprocess::create_only,
+                "mapi_test", 1024 * 1024);
+        loader.insert(vec.begin(), vec.end());
+        assert(loader.insert(std::make_pair("test3", 2)));
+        assert(!loader.insert(std::make_pair("test3", 3)));
+        std::cout.flush();
+        pid_t child = fork();
+        assert(child >= 0);
+        if( child == 0 )
+            _exit(attach_shm("mapi_test"));
+        int status = 0;
+        assert(waitpid(child, &status, 0) == child);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+        shm_mapi_test worker(boost::interprocess::open_only,
+                "mapi_test");
+        assert(worker.size() == 3);
+        assert(worker.validate());
+        int value = 0;
+        assert(worker.find("test1", value) && value == 1);
+        assert(!worker.find("test9", value));
+        std::vector<std::string> vkeys;
+        worker.findv(2, vkeys);
+        assert(vkeys.size() == 2);
+        assert(worker.countv(3) == 0);
+        assert(loader.erase("test2") == 1);
+        assert(loader.erase("test2") == 0);
+        assert(worker.countv(2) == 1);
+        assert(worker.validate());
+        loader.clear();
+        assert(worker.empty());
+    }
+    assert(shm_mapi_test::remove("mapi_test"));
+    // при исчерпании сегмента вставка не оставляет элемент без записи в индексе
+    for (std::size_t length = 1; length < 200; length += 16)
+    {
+        shm_mapi_test full(boost::interprocess::create_only, "mapi_test",
+                16 * 1024);
+        std::vector<std::string> inserted;
+        try
+        {
+            for (int j = 0;; ++j)
+            {
+                ostg << j << std::string(length, 'k');
+                full.insert(std::make_pair(ostg.str(), j % 7));
+                inserted.push_back(ostg.str());
+                ostg.str("");
+            }
+        }
+        catch (const boost::interprocess::bad_alloc&)
+        {
+            ostg.str("");
+        }
+        assert(full.size() == inserted.size() && full.validate());
+        for (std::size_t k = 0; k < inserted.size(); ++k)
+            assert(full.erase(inserted[k]) == 1);
+        assert(full.empty() && full.validate());
+        assert(shm_mapi_test::remove("mapi_test"));
+    }
+    std::cout << _("OK\n");
+    std::cout << _("Test 21 Reloading published versions: ");
+    std::map<std::string, int> data;
+    for (int j = 0; j < 1000; ++j)
+    {
+        ostg << "test" << j;
+        data[ostg.str()] = 0;
+        ostg.str("");
+    }
+    mapi_publisher<std::string, int> publisher(data);
+    mapi_publisher<std::string, int>::pointer first = publisher.current();
+    assert(first->validate());
+    work = true;
+    count = 0;
+    boost::thread thrd3(read_published, boost::ref(publisher), &work, &count);
+    for (int j = 1; j <= 20; ++j)
+    {
+        for (std::map<std::string, int>::iterator k = data.begin();
+                k != data.end(); ++k)
+            k->second = j;
+        publisher.reload(data);
+    }
+    work = false;
+    thrd3.join();
+    assert(first->countv(0) == 1000);
+    assert(first->validate());
+    assert(publisher.current()->countv(20) == 1000);
+    assert(publisher.current()->validate());
+    publisher.reclaim();
+    assert(publisher.retired() == 1);
+    first.reset();
+    publisher.reclaim();
+    assert(publisher.retired() == 0);
+    std::cout << _("tested ") << count << _(" times OK\n");
+    std::cout << _("Test 22 Deferred destruction: ");
+    boost::shared_ptr<mapi_reclaimer> reclaimer(new mapi_reclaimer);
+    mapi<std::string, int> deferred(data);
+    deferred.set_reclaimer(reclaimer);
+    mapi<std::string, int>::iterator from = deferred.find("test100");
+    mapi<std::string, int>::iterator to = deferred.find("test200");
+    deferred.erase(from, to);
+    reclaimer->wait();
+    assert(reclaimer->pending() == 0);
+    assert(deferred.size() == 1000 - 111);
+    assert(deferred.countv(20) == 1000 - 111);
+    assert(deferred.find("test150") == deferred.end());
+    assert(deferred.find("test200") != deferred.end());
+    assert(deferred.validate());
+    deferred.clear();
+    assert(deferred.empty());
+    assert(deferred.countv(20) == 0);
+    assert(deferred.validate());
+    deferred.insert(std::make_pair("test1", 1));
+    assert(deferred.findv(1).size() == 1);
+    deferred.erase(deferred.begin(), deferred.end());
+    assert(deferred.empty());
+    deferred.set_reclaimer(boost::shared_ptr<mapi_reclaimer>());
+    deferred = data;
+    deferred.clear();
+    assert(deferred.validate());
+    reclaimer->wait();
+    std::cout << _("OK\n");
+    std::cout << _("Test 23 Binary serialization: ");
+    std::stringstream stored;
+    mapi<std::string, int> source(data);
+    source["test7"] = 7;
+    source.serialize(stored);
+    mapi<std::string, int> loaded;
+    loaded.insert(std::make_pair("old", 1));
+    loaded.enable_filter(100, 10);
+    loaded.deserialize(stored);
+    assert(loaded.size() == 1000);
+    assert(loaded.validate());
+    assert(loaded.find("old") == loaded.end());
+    assert(loaded.find("test7") != loaded.end());
+    assert(loaded.countv(20) == 999);
+    assert(loaded.findv(7).size() == 1);
+    std::string image = stored.str();
+    std::istringstream truncated(image.substr(0, image.size() - 1));
+    try
+    {
+        loaded.deserialize(truncated);
+        assert(false);
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+    assert(loaded.size() == 1000);
+    std::istringstream garbled("not a mapi");
+    try
+    {
+        loaded.deserialize(garbled);
+        assert(false);
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+    mapi<std::string, state> states;
+    states.insert(std::make_pair("a", running));
+    states.insert(std::make_pair("b", stopped));
+    std::stringstream stored_states;
+    states.serialize(stored_states);
+    mapi<std::string, state> loaded_states;
+    loaded_states.deserialize(stored_states);
+    assert(loaded_states.findv(stopped).size() == 1);
+    assert(loaded_states.validate());
+    std::cout << _("OK\n");
+    std::cout << _("Test 24 Change feed: ");
+    typedef mapi_feed<std::string, int> feed_test;
+    boost::shared_ptr<feed_test> feed(new feed_test(8));
+    mapi<std::string, int> primary(vec.begin(), vec.end());
+    primary.set_feed(feed);
+    std::map<std::string, int> replica;
+    boost::uint64_t next = primary.snapshot(replica);
+    assert(next == 0 && replica.size() == 2);
+    primary.insert(std::make_pair("test3", 3));
+    primary["test1"] = 5;
+    primary.erase("test2");
+    primary.erase("test9");
+    assert(feed->wait(next, boost::posix_time::milliseconds(0)));
+    std::vector<feed_test::change> changes;
+    assert(feed->read(next, changes));
+    assert(changes.size() == 3);
+    assert(changes[1].op == mapi_change_assign);
+    assert(changes[1].old_value == 1 && changes[1].new_value == 5);
+    next = mapi_apply(replica, changes.begin(), changes.end(), next);
+    assert(next == 3);
+    std::map<std::string, int> expected;
+    assert(primary.snapshot(expected) == next);
+    assert(replica == expected);
+    mapi<std::string, int> replica_mapi(expected);
+    primary.clear();
+    primary.insert(std::make_pair("test4", 4));
+    assert(feed->read(next, changes, 1) && changes.size() == 1);
+    next = mapi_apply(replica_mapi, changes.begin(), changes.end(), next);
+    assert(feed->read(next, changes));
+    next = mapi_apply(replica_mapi, changes.begin(), changes.end(), next);
+    assert(replica_mapi.size() == 1 && replica_mapi.findv(4).size() == 1);
+    assert(replica_mapi.validate());
+    assert(!feed->wait(next, boost::posix_time::milliseconds(1)));
+    for (int j = 0; j < 10; ++j)
+        primary["test4"] = j;
+    assert(!feed->read(next, changes));
+    next = primary.snapshot(replica);
+    assert(feed->read(next, changes) && changes.empty());
+    assert(replica.size() == 1 && replica["test4"] == 9);
+    // замена содержимого пишется одной записью, после нее реплика строится заново
+    std::map<std::string, int> reload_map;
+    reload_map["test5"] = 5;
+    reload_map["test6"] = 6;
+    primary.set_capacity(10);
+    primary.enable_filter(10, 10);
+    primary = reload_map;
+    assert(feed->wait(next, boost::posix_time::milliseconds(0)));
+    assert(!feed->read(next, changes));
+    next = primary.snapshot(replica);
+    assert(replica == reload_map && feed->read(next, changes) && changes.empty());
+    assert(primary.get("test5") == 5 && !primary.get("test4"));
+    assert(primary.validate());
+    std::cout << _("OK\n");
+    std::cout << _("Test 25 Parallel validate and index rebuild: ");
+    std::map<std::string, int> big;
+    for (int j = 0; j < 100000; ++j)
+    {
+        ostg << "test" << j;
+        big[ostg.str()] = j % 7;
+        ostg.str("");
+    }
+    mapi<std::string, int> large(big);
+    large.enable_bitmap(
+            boost::shared_ptr<mapi_key_space<std::string> >(
+                    new mapi_key_space<std::string>));
+    assert(large.validate(4));
+    assert(large.validate(3));
+    std::vector<mapi<std::string, int>::iterator> before = large.findv(3);
+    large.rebuild_index(4);
+    assert(large.validate(4));
+    assert(large.findv(3) == before);
+    assert(large.countv(6) == 14285);
+    large.erase("test3");
+    large["test10"] = 3;
+    assert(large.validate(8));
+    volatile bool validating = true;
+    volatile int validated = 0;
+    boost::thread validator(check, boost::ref(large), &validating, &validated);
+    for (int j = 0; j < 10000 || validated < 2; ++j)
+    {
+        ostg << "test" << j % 1000;
+        large[ostg.str()] = j % 7;
+        assert(large.find(ostg.str()) != large.end());
+        ostg.str("");
+    }
+    validating = false;
+    validator.join();
+    assert(large.validate(2));
+    mapi<std::string, int> small;
+    assert(small.validate(4));
+    small.rebuild_index(4);
+    assert(small.validate(1));
+    std::cout << _("OK\n");
+    std::cout << _("Test 26 Moving nodes between objects: ");
+    mapi<std::string, int> staging(vec.begin(), vec.end()), live;
+    staging.insert(std::make_pair("test3", 2));
+    mapi<std::string, int>::node_type node = staging.extract("test1");
+    assert(node && node.key() == "test1" && node.value() == 1);
+    assert(!staging.extract("test9"));
+    const std::string *moved = &node.key();
+    assert(live.insert(std::move(node)).second);
+    assert(node.empty());
+    mapi<std::string, int>::iterator linked = live.find("test1");
+    assert(&linked->first == moved);
+    linked->second = 4;
+    assert(live.findv(4).size() == 1 && live.validate());
+    live.insert(std::make_pair("test3", 7));
+    live.merge(staging);
+    assert(live.size() == 3 && staging.size() == 1);
+    assert(staging.find("test3") != staging.end());
+    assert(live.countv(2) == 1 && live.countv(7) == 1);
+    live["test2"] = 5;
+    assert(live.findv(5).size() == 1);
+    assert(live.validate() && staging.validate());
+    node = live.extract(live.find("test2"));
+    live.insert(std::make_pair("test2", 6));
+    assert(!live.insert(std::move(node)).second);
+    assert(node && node.value() == 5);
+    assert(staging.insert(std::move(node)).second);
+    live.insert(std::make_pair("test9", 9));
+    staging.splice(live, live.find("test1"), live.find("test9"));
+    assert(live.size() == 3 && staging.size() == 3);
+    assert(staging.countv(4) == 1 && staging.countv(5) == 1);
+    assert(live.countv(6) == 1 && live.countv(9) == 1);
+    assert(live.validate() && staging.validate());
+    mapi<std::string, state> dense_from, dense_to;
+    dense_from.insert(std::make_pair("a", running));
+    dense_from.insert(std::make_pair("b", stopped));
+    dense_to.merge(dense_from);
+    assert(dense_from.empty() && dense_to.findv(stopped).size() == 1);
+    assert(dense_to.validate());
+    std::cout << _("OK\n");
+    std::cout << _("Test 27 Top-K and value ordered pages: ");
+    mapi<std::string, int> scores;
+    for (int j = 0; j < 100; ++j)
+    {
+        ostg << "test" << j;
+        scores.insert(std::make_pair(ostg.str(), j / 2));
+        ostg.str("");
+    }
+    std::vector<mapi<std::string, int>::iterator> top = scores.top_k(3);
+    assert(top.size() == 3);
+    assert(top[0]->first == "test99" && top[1]->first == "test98");
+    assert(top[2]->second == 48);
+    std::vector<mapi<std::string, int>::iterator> bottom = scores.bottom_k(2);
+    assert(bottom.size() == 2 && bottom[0]->first == "test0");
+    assert(bottom[1]->first == "test1");
+    assert(scores.top_k(1000).size() == 100);
+    mapi_cursor<std::string, int> cursor;
+    std::vector<mapi<std::string, int>::iterator> page =
+            scores.next_page(cursor, 30);
+    assert(page.size() == 30 && !cursor.end());
+    assert(cursor.value() == 14 && cursor.key() == "test29");
+    scores.erase("test30");
+    scores.insert(std::make_pair("test0a", 14));
+    scores.insert(std::make_pair("test2a", 14));
+    page = scores.next_page(cursor, 30);
+    assert(page.size() == 30 && page[0]->first == "test2a");
+    assert(page[1]->first == "test31");
+    mapi_cursor<std::string, int> resumed(cursor.value(), cursor.key());
+    std::size_t rest = 0;
+    while (!resumed.end())
+        rest += scores.next_page(resumed, 7).size();
+    assert(rest == 100 + 2 - 1 - 1 - 60);
+    mapi<std::string, state> machines;
+    machines.insert(std::make_pair("m3", running));
+    machines.insert(std::make_pair("m1", running));
+    machines.insert(std::make_pair("m2", stopped));
+    machines.insert(std::make_pair("m0", idle));
+    std::vector<mapi<std::string, state>::iterator> busiest =
+            machines.top_k(2);
+    assert(busiest[0]->first == "m2" && busiest[1]->first == "m3");
+    mapi_cursor<std::string, state> mcursor;
+    std::vector<mapi<std::string, state>::iterator> mpage =
+            machines.next_page(mcursor, 2);
+    assert(mpage[0]->first == "m0" && mpage[1]->first == "m1");
+    mpage = machines.next_page(mcursor, 5);
+    assert(mpage.size() == 2 && mpage[0]->first == "m3");
+    assert(mcursor.end());
+    for (int j = 0; j < 2000; ++j)
+    {
+        ostg << "m" << 1000 + j;
+        machines.insert(std::make_pair(ostg.str(), running));
+        ostg.str("");
+    }
+    mapi_cursor<std::string, state> walk;
+    std::string prev;
+    std::size_t walked = 0;
+    while (!walk.end())
+    {
+        mpage = machines.next_page(walk, 64);
+        for (std::size_t k = 0; k < mpage.size(); ++k, ++walked)
+            if( mpage[k]->second == running )
+            {
+                assert(prev < mpage[k]->first);
+                prev = mpage[k]->first;
+            }
+        machines.erase(machines.begin());
+    }
+    assert(walked > 1900 && walked <= 2004);
+    busiest = machines.top_k(3);
+    assert(busiest[0]->first == "m2" && busiest[1]->first == "m3");
+    assert(busiest[2]->first == "m2999" && machines.validate());
+    std::cout << _("OK\n");
+    std::cout << _("Test 28 Chunked and parallel for_each: ");
+    mapi<std::string, int> scanned;
+    for (int j = 0; j < 100000; ++j)
+    {
+        ostg << "key" << j;
+        scanned.insert(std::make_pair(ostg.str(), j));
+        ostg.str("");
+    }
+    work = true;
+    boost::thread thrd4(churn, boost::ref(scanned), &work);
+    for (int j = 0; j < 5; ++j)
+    {
+        sum_values s = scanned.for_each(sum_values(), 100);
+        assert(s.count == 100000 && s.sum == 4999950000LL);
+        std::vector<sum_values> parts = scanned.parallel_for_each(
+                sum_values(), 4, 1000);
+        assert(parts.size() <= 4);
+        s = sum_values();
+        for (std::vector<sum_values>::const_iterator k = parts.begin();
+                k != parts.end(); ++k)
+        {
+            s.count += k->count;
+            s.sum += k->sum;
+        }
+        assert(s.count == 100000 && s.sum == 4999950000LL);
+    }
+    work = false;
+    thrd4.join();
+    assert(scanned.validate());
+    mapi<std::string, int> unscanned;
+    assert(unscanned.parallel_for_each(sum_values(), 4).size() == 1);
+    assert(scanned.for_each(sum_values(), 0).count == 100000);
+    assert(scanned.for_each(lookup_values(scanned), 64).found == 100000);
+    std::cout << _("OK\n");
+    std::cout << _("Test 29 Optimistic reads: ");
+    assert(scanned.get("key5") == 5);
+    assert(!scanned.get("key100000"));
+    work = true;
+    boost::thread thrd5(churn, boost::ref(scanned), &work);
+    for (int j = 0; j < 200000; ++j)
+    {
+        ostg << "key" << j % 100000;
+        std::optional<int> got = scanned.get(ostg.str());
+        assert(got && *got == j % 100000);
+        ostg.str("");
+        // ключ, который вставляет и удаляет churn, либо отсутствует, либо имеет значение -1
+        got = scanned.get("test50");
+        assert(!got || *got == -1);
+    }
+    work = false;
+    thrd5.join();
+    scanned["key5"] = 6;
+    assert(*scanned.get("key5") == 6);
+    scanned.erase("key5");
+    assert(!scanned.get("key5"));
+    assert(scanned.validate());
+    std::cout << _("OK\n");
+    std::cout << _("Test 30 Capacity bounded cache: ");
+    // кольцо CLOCK и счетчики поисков создаются только при задании емкости
+    assert(sizeof(mapi<std::string, int>) < 1024);
+    assert(sizeof(mapi<std::string, int>::mapped_type) <= 3 * sizeof(void*));
+    mapi<std::string, state> sessions;
+    sessions.insert(std::make_pair("s0", idle));
+    assert(sessions.find("s0") != sessions.end());
+    assert(!sessions.cache_stats().hits && !sessions.cache_stats().misses);
+    sessions.erase("s0");
+    sessions.set_capacity(3);
+    sessions.insert(std::make_pair("s1", idle));
+    sessions.insert(std::make_pair("s2", running));
+    sessions.insert(std::make_pair("s3", running));
+    // первый оборот сбрасывает биты всех элементов, s1 вытесняется первым
+    sessions.insert(std::make_pair("s4", stopped));
+    assert(sessions.size() == 3 && sessions.find("s1") == sessions.end());
+    assert(sessions.findv(idle).empty() && sessions.validate());
+    // после обращения s2 остается, вытесняется s3
+    assert(sessions.get("s2") == running);
+    sessions["s5"] = idle;
+    assert(sessions.size() == 3);
+    assert(sessions.find("s2") != sessions.end());
+    assert(sessions.find("s3") == sessions.end());
+    assert(sessions.countv(running) == 1 && sessions.validate());
+    mapi_cache_stats cst = sessions.cache_stats();
+    assert(cst.evictions == 2 && cst.misses == 2 && cst.hits == 2);
+    sessions.erase("s2");
+    sessions.insert(std::make_pair("s6", running));
+    assert(sessions.size() == 3 && sessions.cache_stats().evictions == 2);
+    sessions.set_capacity(1);
+    assert(sessions.size() == 1 && sessions.validate());
+    sessions.set_capacity(0);
+    for (int j = 0; j < 10; ++j)
+    {
+        ostg << "s" << j + 10;
+        sessions.insert(std::make_pair(ostg.str(), idle));
+        ostg.str("");
+    }
+    assert(sessions.size() == 11 && sessions.validate());
+    // поиск по значению выставляет бит обращения, но не учитывается в статистике
+    mapi<std::string, int> warm;
+    warm.set_capacity(3);
+    warm.insert(std::make_pair("a", 1));
+    warm.insert(std::make_pair("b", 2));
+    warm.insert(std::make_pair("c", 3));
+    warm.insert(std::make_pair("d", 4));
+    assert(warm.find("a") == warm.end());
+    assert(warm.findv(2).size() == 1);
+    warm.insert(std::make_pair("e", 5));
+    assert(warm.find("b") != warm.end() && warm.find("c") == warm.end());
+    std::vector<std::string> warm_keys;
+    warm_keys.push_back("b");
+    warm_keys.push_back("zz");
+    std::vector<mapi<std::string, int>::iterator> warm_found;
+    warm.find_many(warm_keys, warm_found);
+    cst = warm.cache_stats();
+    assert(cst.hits == 2 && cst.misses == 3 && cst.evictions == 2);
+    mapi<std::string, int> bounded;
+    bounded.set_capacity(1000);
+    work = true;
+    boost::thread thrd6(churn, boost::ref(bounded), &work);
+    for (int j = 0; j < 20000; ++j)
+    {
+        ostg << "key" << j;
+        bounded.insert(std::make_pair(ostg.str(), j % 10));
+        ostg.str("");
+        bounded.get("test1");
+        assert(bounded.size() <= 1000);
+    }
+    work = false;
+    thrd6.join();
+    assert(bounded.size() <= 1000 && bounded.validate());
+    mapi<std::string, int> counted;
+    counted.insert(std::make_pair("key0", 0));
+    counted.set_capacity(10);
+    boost::thread lookup1(lookup_n, boost::cref(counted), 10000);
+    boost::thread lookup2(lookup_n, boost::cref(counted), 10000);
+    boost::thread lookup3(lookup_n, boost::cref(counted), 10000);
+    lookup_n(counted, 10000);
+    lookup1.join();
+    lookup2.join();
+    lookup3.join();
+    cst = counted.cache_stats();
+    assert(cst.hits == 40000 && cst.misses == 40000 && !cst.evictions);
+    std::cout << _("OK\n");
+    std::cout << _("Test 31 Keys stored once: ");
+    typedef mapi<std::string, int>::mapped_type proxy;
+    assert(sizeof(proxy) < sizeof(std::string) + 2 * sizeof(void*));
+    mapi<std::string, int> paths, more;
+    paths.insert(std::make_pair("/usr/share/doc/mapi/README", 1));
+    paths.insert(std::make_pair("/usr/share/doc/mapi/NEWS", 2));
+    more.insert(std::make_pair("/usr/share/doc/mapi/TODO", 2));
+    paths.merge(more);
+    std::stringstream stored_paths;
+    paths.serialize(stored_paths);
+    more.deserialize(stored_paths);
+    more.find("/usr/share/doc/mapi/NEWS")->second = 3;
+    assert(more.top_k(1)[0]->first == "/usr/share/doc/mapi/NEWS");
+    std::vector<mapi<std::string, int>::iterator> twos = paths.findv(2);
+    assert(twos.size() == 2 && twos[1]->first == "/usr/share/doc/mapi/TODO");
+    paths.find("/usr/share/doc/mapi/TODO")->second = 1;
+    paths.rebuild_index();
+    assert(paths.countv(1) == 2 && paths.validate() && more.validate());
+    std::cout << _("OK\n");
+    std::cout << _("Test 32 Key prefix: ");
+    mapi<std::string, int> tree;
+    tree.enable_filter(100, 10);
+    tree["/etc/hosts"] = 1;
+    tree["/usr/bin/ls"] = 2;
+    tree["/usr/bin/cp"] = 2;
+    tree["/usr/lib/libc.so"] = 3;
+    tree["/usr/libexec/ssh"] = 4;
+    tree["/var/log/syslog"] = 5;
+    tree[std::string("/usr/\xff", 6)] = 6;
+    tree[std::string("/usr/\xff\xff", 7)] = 7;
+    std::vector<mapi<std::string, int>::iterator> bins = tree.find_prefix(
+            "/usr/bin/");
+    assert(bins.size() == 2 && bins[0]->first == "/usr/bin/cp");
+    assert(bins[1]->first == "/usr/bin/ls");
+    assert(tree.find_prefix("/usr/lib").size() == 2);
+    assert(tree.find_prefix("/usr/").size() == 6);
+    assert(tree.find_prefix(std::string("/usr/\xff", 6)).size() == 2);
+    assert(tree.find_prefix("/opt/").empty());
+    const mapi<std::string, int>& ctree = tree;
+    assert(ctree.find_prefix("").size() == tree.size());
+    assert(tree.erase_prefix("/usr/bin/") == 2);
+    assert(tree.findv(2).empty() && tree.find("/usr/bin/ls") == tree.end());
+    assert(tree.size() == 6 && tree.validate());
+    assert(tree.erase_prefix("/usr/") == 4);
+    assert(tree.size() == 2 && tree.validate());
+    assert(tree.findv(3).empty() && tree.findv(5).size() == 1);
+    assert(tree.erase_prefix("/opt/") == 0);
+    tree["/usr/lib/libm.so"] = 3;
+    assert(tree.findv(3).size() == 1 && tree.validate());
+    std::cout << _("OK\n");
+    std::cout << _("Test 33 Workload trace: ");
+    std::stringstream trace;
+    {
+        mapi<std::string, int> traced;
+        traced["one"] = 1;
+        boost::shared_ptr<mapi_recorder> rec(new mapi_recorder(trace));
+        traced.set_recorder(rec);
+        traced.find("one");
+        traced.get("two");
+        traced.insert(std::make_pair("three", 3));
+        traced["four"] = 4;
+        traced.findv(4);
+        traced.erase("one");
+        traced.clear();
+        rec->stop();
+        traced.find("after stop");
+        assert(rec->records() == 9);
+    }
+    mapi_trace_reader trace_reader(trace);
+    std::vector<mapi_trace_record> records;
+    for (mapi_trace_record r; trace_reader.read(r);)
+        records.push_back(r);
+    assert(records.size() == 9);
+    const mapi_trace_op ops[] =
+    { mapi_trace_preload, mapi_trace_find, mapi_trace_get, mapi_trace_insert,
+            mapi_trace_subscript, mapi_trace_assign, mapi_trace_findv,
+            mapi_trace_erase, mapi_trace_clear };
+    for (std::size_t j = 0; j < records.size(); ++j)
+    {
+        assert(records[j].op == ops[j]);
+        assert(records[j].thread == records[0].thread);
+        assert(j < 2 || records[j].time >= records[j - 1].time);
+    }
+    assert(records[0].key == records[1].key && records[0].key_size == 3);
+    assert(records[0].value == 1 && records[1].value == 0);
+    assert(records[5].key == records[4].key && records[5].value == 4);
+    assert(records[6].key_size == 0 && records[6].value == 4);
+    assert(records[2].key != records[1].key && records[3].key_size == 5);
+    // потоки пишут в свои буферы, пачки разных потоков чередуются, порядок внутри потока сохраняется
+    std::stringstream threaded_trace;
+    {
+        mapi<std::string, int> traced;
+        traced["key0"] = 0;
+        boost::shared_ptr<mapi_recorder> rec(new mapi_recorder(threaded_trace));
+        traced.set_recorder(rec);
+        boost::thread tracer1(lookup_n, boost::cref(traced), 3000);
+        boost::thread tracer2(lookup_n, boost::cref(traced), 3000);
+        boost::thread tracer3(lookup_n, boost::cref(traced), 3000);
+        tracer1.join();
+        tracer2.join();
+        tracer3.join();
+        rec->stop();
+        assert(rec->records() == 18001);
+    }
+    mapi_trace_reader threaded_reader(threaded_trace);
+    std::map<boost::uint16_t, std::vector<mapi_trace_record> > by_thread;
+    for (mapi_trace_record r; threaded_reader.read(r);)
+        if( r.op != mapi_trace_preload )
+            by_thread[r.thread].push_back(r);
+    assert(by_thread.size() == 3);
+    for (std::map<boost::uint16_t, std::vector<mapi_trace_record> >::const_iterator i =
+            by_thread.begin(); i != by_thread.end(); ++i)
+    {
+        assert(i->second.size() == 6000);
+        for (std::size_t j = 1; j < i->second.size(); ++j)
+            assert(i->second[j].time >= i->second[j - 1].time);
+    }
+    std::cout << _("OK\n");
     return EXIT_SUCCESS;
 }
 catch (const std::exception& e)
@@ -11,8 +11,27 @@
 #include <map>
 #include <vector>
 #include <iostream>
+#include <algorithm>
 #include <cassert>
+#include <stdexcept>
+#include <optional>
+#include <memory>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/unordered_map.hpp>
+#include "mapi_index.h"
+#include "mapi_bitmap.h"
+#include "mapi_filter.h"
+#include "mapi_reclaim.h"
+#include "mapi_serialize.h"
+#include "mapi_feed.h"
+#include "mapi_gate.h"
+#include "mapi_trace.h"
 
 // опережающее описание mapi
 template<typename Key, typename T>
@@ -35,9 +54,16 @@ template<typename Key, typename T>
  * Для доступа к значению T реализован оператор приведения типа operator T() и оператор присваивания
  * reference_mapped_type& operator=(const T&). Для операций ++, --, +=  и т.п. этого недостаточно.
  *
+ * Ключ не копируется: m_key указывает на ключ в узле mapi::m_map, адрес которого не меняется
+ * до удаления элемента, в том числе при переносе узла между mapi (extract, merge).
+ *
+ * От mapi_index_hook наследуются служебные данные индекса (для плотного индекса - позиция в корзине).
+ * Данные режима ограниченной емкости (mapi::set_capacity) хранятся не здесь, а в кольце CLOCK mapi,
+ * поэтому элементы mapi без ограничения емкости за них не платят.
+ *
  */
 template<typename Keyr, typename Tr>
-    class reference_mapped_type
+    class reference_mapped_type : public mapi_index_hook<Tr>
     {
         template<typename Key, typename T>
             friend class mapi;
@@ -53,26 +79,22 @@ template<typename Keyr, typename Tr>
         {
             assert(m_mapi);
             //в случае неправильного использования возникает assert
+            m_mapi->trace(mapi_trace_assign, *m_key, v);
             boost::mutex::scoped_lock lock(m_mapi->m_mutex);
+            mapi_read_gate::writer gate(m_mapi->readgate());
             if( v != m_value )
-            {
-                m_mapi->delindex(m_mapi->m_map.find(m_key));
-                m_mapi->m_index.insert(std::make_pair(v, m_key));
-                m_value = v;
-            }
+                m_mapi->setvalue(m_mapi->m_map.find(*m_key), v);
             return *this;
         }
         reference_mapped_type&
         operator=(const reference_mapped_type& m)
         {
             assert(m_mapi);
+            m_mapi->trace(mapi_trace_assign, *m_key, m.m_value);
             boost::mutex::scoped_lock lock(m_mapi->m_mutex);
+            mapi_read_gate::writer gate(m_mapi->readgate());
             if( m.m_value != m_value )
-            {
-                m_mapi->delindex(m_mapi->m_map.find(m_key));
-                m_mapi->m_index.insert(std::make_pair(m.m_value, m_key));
-                m_value = m.m_value;
-            }
+                m_mapi->setvalue(m_mapi->m_map.find(*m_key), m.m_value);
             return *this;
         }
         bool
@@ -91,29 +113,162 @@ template<typename Keyr, typename Tr>
             return m_value < v;
         }
         reference_mapped_type() :
-                m_mapi(0), m_key(Keyr()), m_value(Tr())
+                m_mapi(0), m_key(0), m_value(Tr())
+        {
+        }
+        reference_mapped_type(const reference_mapped_type& x) :
+                mapi_index_hook<Tr>(x), m_mapi(x.m_mapi), m_key(x.m_key), m_value(
+                        x.m_value)
         {
         }
     private:
-        reference_mapped_type(mapi<Keyr, Tr> *m, const Keyr& k, const Tr& v) :
-                m_mapi(m), m_key(k), m_value(v)
+        reference_mapped_type(mapi<Keyr, Tr> *m, const Tr& v) :
+                m_mapi(m), m_key(0), m_value(v)
         {
         }
         //указатель на родительский объект
         mapi<Keyr, Tr> *m_mapi;
-        //ключ, которому в mapi:m_map соответствует m_value
-        Keyr m_key;
+        //ключ в узле mapi::m_map, которому соответствует m_value, задается после вставки узла
+        const Keyr *m_key;
         //собственно значение
         Tr m_value;
     };
+/*
+ * Статистика mapi в режиме ограниченной емкости (см. mapi::set_capacity).
+ */
+struct mapi_cache_stats
+{
+    mapi_cache_stats() :
+            hits(0), misses(0), evictions(0)
+    {
+    }
+    //успешные поиски по ключу (find, get, find_many - по каждому ключу набора). Поиски по значению,
+    //префиксу и обходы в порядке значений выставляют биты обращения найденных элементов, но
+    //в статистике не учитываются
+    std::size_t hits;
+    //неудачные поиски по ключу
+    std::size_t misses;
+    //вытесненные элементы
+    std::size_t evictions;
+};
+
+/*
+ * Позиция постраничного обхода mapi в порядке значений (см. mapi::next_page). Хранит последнюю выданную
+ * пару (значение, ключ), а не итератор, поэтому остается действительной при любых изменениях mapi:
+ * следующая страница начинается с первой пары, большей сохраненной.
+ */
+template<typename Key, typename T>
+    class mapi_cursor
+    {
+        template<typename Keym, typename Tm>
+            friend class mapi;
+    public:
+        //обход с начала
+        mapi_cursor() :
+                m_started(false), m_end(false), m_value(), m_key()
+        {
+        }
+        //продолжение обхода после пары (v, k), например сохраненной между запросами
+        mapi_cursor(const T& v, const Key& k) :
+                m_started(true), m_end(false), m_value(v), m_key(k)
+        {
+        }
+        //последняя страница была неполной, обход закончен
+        bool
+        end() const
+        {
+            return m_end;
+        }
+        //выдана хотя бы одна страница, value и key имеют смысл
+        bool
+        started() const
+        {
+            return m_started;
+        }
+        const T&
+        value() const
+        {
+            return m_value;
+        }
+        const Key&
+        key() const
+        {
+            return m_key;
+        }
+    private:
+        bool m_started;
+        bool m_end;
+        T m_value;
+        Key m_key;
+    };
+
 /*
  * Класс mapi. Представляет из себя урезанный вариант класса map, но с возможность быстрого поиска по значению.
  * В частности урезаны параметры шаблона: тип объекта сравнения Compare, аллокатор Alloc. В качестве их типов
  * приняты значения по умолчанию.
  *
- * Хранение данных осуществляется в std::map m_map. Индекс быстрого поиска хранится в std::multimap m_index.
+ * Хранение данных осуществляется в std::map m_map. Индекс быстрого поиска хранится в m_index, по умолчанию
+ * это std::multimap (см. mapi_index). Для целочисленных T и перечислений с объявленной через mapi_dense_value
+ * границей используется плотный индекс - массив корзин по значениям.
  * Для быстрого поиска по значению реализован метод std::vector<iterator> findv(const T&) и константный
  * вариант std::vector<const_iterator> findv(const T&) const, которые возвращают вектор итераторов.
+ * Метод countv(const T&) возвращает количество элементов с заданным значением.
+ * Для пакетного поиска служат find_many и findv_many: блокировка захватывается один раз, пробы
+ * сортируются и ищутся от предыдущего найденного элемента, результаты записываются в буферы вызывающего.
+ *
+ * Дополнительно может быть включен битовый индекс (enable_bitmap): для каждого значения хранится
+ * mapi_bitmap порядковых номеров ключей из пространства ключей mapi_key_space. Запросы по множеству
+ * значений (findv_any, bitmap_any) выполняются объединением битовых карт, а битовые карты двух mapi
+ * с общим пространством ключей можно пересекать.
+ *
+ * Фильтры Блума по ключам и значениям (enable_filter) позволяют find и findv отвечать на заведомо
+ * неудачный поиск без блокировки и без обхода дерева. Статистика фильтров - key_filter_stats
+ * и value_filter_stats. Фильтры читаются через шлюз читателей mapi_read_gate, а при очистке
+ * и перезагрузке (clear, operator=, deserialize) заменяются новыми, заполненными под блокировкой,
+ * поэтому поиск, параллельный перезагрузке, не теряет ключи, существующие до и после нее.
+ *
+ * clear() и удаление диапазона под блокировкой только отсоединяют узлы основного хранилища и индексов,
+ * освобождение памяти выполняется после снятия блокировки, а при заданном set_reclaimer - в фоновом
+ * потоке mapi_reclaimer. Поэтому очистка большого mapi не задерживает поиск в других потоках.
+ *
+ * Для сохранения и загрузки служат serialize и deserialize (формат см. mapi_serialize.h), в отличие
+ * от operator<< пишутся только элементы основного хранилища, индекс при загрузке строится заново.
+ *
+ * Для поддержки реплик к mapi подключается журнал изменений mapi_feed (set_feed), в который записываются
+ * вставки, удаления, изменения значений и очистки. Реплика строится snapshot и затем обновляется
+ * записями журнала. Замена всего содержимого (deserialize, operator=) пишется одной записью
+ * mapi_change_reload, после нее реплика строится заново.
+ *
+ * Элементы переносятся между mapi без выделения памяти и копирования ключей и значений: extract
+ * извлекает узлы основного хранилища и индекса, insert(node_type&&) вставляет их в другой mapi,
+ * merge и splice переносят все элементы или диапазон.
+ *
+ * Обход в порядке значений (при равных значениях - в порядке ключей) выполняется постранично next_page
+ * с позицией mapi_cursor, top_k и bottom_k возвращают n элементов с наибольшими и наименьшими
+ * значениями, просматривая только край индекса.
+ *
+ * begin() и end() возвращают итераторы без блокировки. Для обхода, параллельного с изменениями, служат
+ * for_each и parallel_for_each: обход идет частями по chunk элементов, часть копируется под блокировкой,
+ * функция вызывается для копии без блокировки, и следующая часть начинается с ключа, следующего за
+ * последним скопированным.
+ *
+ * Метод get(k) возвращает копию значения без захвата m_mutex через шлюз читателей mapi_read_gate.
+ * Первый вызов get создает шлюз, после чего каждое изменение основного хранилища дожидается
+ * окончания начатых get. До этого mapi хранит только нулевой указатель на шлюз. Выгоден для небольших T, которые дешево копировать.
+ *
+ * В режиме ограниченной емкости (set_capacity) при вставке сверх емкости вытесняются давно
+ * не использованные элементы по алгоритму CLOCK за амортизированное O(1): find и get только
+ * выставляют бит обращения атомарной записью, вставка обходит кольцо и удаляет первый элемент
+ * со сброшенным битом из основного хранилища и индекса.
+ *
+ * Для воспроизведения реальной нагрузки без передачи данных к mapi подключается запись трассы
+ * mapi_recorder (set_recorder): операции find, get, findv, insert, operator[], присваивание значения,
+ * erase по ключу и clear записываются с хешами ключей и значений, а программа mapi_replay выполняет
+ * трассу в нескольких потоках и выводит пропускную способность и задержки.
+ *
+ * Для ключей std::string реализованы поиск и удаление по префиксу ключа (find_prefix, erase_prefix).
+ * Границы диапазона находятся двумя спусками по дереву, дальше ключи не сравниваются, поэтому
+ * время пропорционально размеру результата.
  *
  * Реализована потокобезопастность методов добавления, удаления и поиска. Потокобезопастность реализована
  * с помощью класса boost::mutex
@@ -138,130 +293,125 @@ template<typename Key, typename T>
         typedef reference_mapped_type<Key, T> mapped_type;
         //тип основного хранилища
         typedef std::map<key_type, mapped_type> map;
-        //тип индекса
-        typedef std::multimap<T, Key> index_type;
         //тип основного итератора
         typedef typename map::iterator iterator;
         //тип основного константного итератора
         typedef typename map::const_iterator const_iterator;
+        //тип индекса
+        typedef mapi_index<Key, T, iterator> index_type;
         //тип размера
         typedef typename map::size_type size_type;
-        //тип индексного итератора
-        typedef typename index_type::iterator index_iterator;
-        //тип констатного индексного итератора
-        typedef typename index_type::const_iterator index_const_iterator;
-        //тип пара индексных итераторов
-        typedef std::pair<index_iterator, index_iterator> pair_index_iterator;
-        //тип пара констатных индексных итераторов
-        typedef std::pair<index_const_iterator, index_const_iterator> pair_index_const_iterator;
         //тип пары основного хранилища
         typedef std::pair<const key_type, mapped_type> value_type;
+        //извлеченный элемент: узлы основного хранилища и индекса, только перемещается
+        class node_type
+        {
+            friend class mapi;
+        public:
+            bool
+            empty() const
+            {
+                return m_node.empty();
+            }
+            explicit
+            operator bool() const
+            {
+                return !empty();
+            }
+            //ключ, для непустого узла
+            const key_type&
+            key() const
+            {
+                return m_node.key();
+            }
+            //значение, для непустого узла
+            T
+            value() const
+            {
+                return m_node.mapped();
+            }
+        private:
+            typename map::node_type m_node;
+            typename index_type::node_type m_index_node;
+        };
         //конструктор по умолчанию
-        mapi()
+        mapi() :
+                m_kfilter(0), m_vfilter(0), m_capacity(0), m_lookups(0),
+                        m_evictions(0), m_gate(0), m_trace(0)
         {
         }
         //копирующий конструктор из std::map
-        mapi(const std::map<Key, T>& x)
+        mapi(const std::map<Key, T>& x) :
+                m_kfilter(0), m_vfilter(0), m_capacity(0), m_lookups(0),
+                        m_evictions(0), m_gate(0), m_trace(0)
         {
-            for (typename std::map<Key, T>::const_iterator i = x.begin();
-                    i != x.end(); ++i)
-            {
-                m_map.insert(
-                        std::make_pair(i->first,
-                                reference_mapped_type<Key, T>(this, i->first,
-                                        i->second)));
-                m_index.insert(std::make_pair(i->second, i->first));
-            }
+            build(x.begin(), x.end(), m_map, m_index);
         }
         //копирующий конструктор из mapi
-        mapi(const mapi& x)
+        mapi(const mapi& x) :
+                m_kfilter(0), m_vfilter(0), m_capacity(0), m_lookups(0),
+                        m_evictions(0), m_gate(0), m_trace(0)
         {
-            for (const_iterator i = x.begin(); i != x.end(); ++i)
-            {
-                m_map.insert(
-                        std::make_pair(i->first,
-                                reference_mapped_type<Key, T>(this, i->first,
-                                        i->second)));
-                m_index.insert(std::make_pair(i->second, i->first));
-            }
+            build(x.begin(), x.end(), m_map, m_index);
         }
         //конструктор из диапазона итераторов
         template<typename InputIterator>
-            mapi(InputIterator first, InputIterator last)
+            mapi(InputIterator first, InputIterator last) :
+                    m_kfilter(0), m_vfilter(0), m_capacity(0), m_lookups(0),
+                            m_evictions(0), m_gate(0), m_trace(0)
             {
-                for (; first != last; ++first)
-                {
-                    std::pair<iterator, bool> pair_ib = m_map.insert(
-                            std::make_pair(first->first,
-                                    reference_mapped_type<Key, T>(this,
-                                            first->first, first->second)));
-                    if( pair_ib.second )
-                        m_index.insert(
-                                std::make_pair(first->second, first->first));
-                }
+                build(first, last, m_map, m_index);
             }
-        //оператор копирования из std::map
+        ~mapi()
+        {
+            delete m_kfilter.load(boost::memory_order_relaxed);
+            delete m_vfilter.load(boost::memory_order_relaxed);
+            delete m_gate.load(boost::memory_order_relaxed);
+            delete m_lookups.load(boost::memory_order_relaxed);
+        }
+        //оператор копирования из std::map. Новое содержимое строится без блокировки, под блокировкой
+        //только подменяется, как в deserialize. При недопустимом значении плотного индекса
+        //бросается std::out_of_range, содержимое в этом случае не меняется
         mapi&
         operator=(const std::map<Key, T>& x)
         {
-            boost::mutex::scoped_lock lock(m_mutex);
-            m_map.clear();
-            m_index.clear();
-            for (typename std::map<Key, T>::const_iterator i = x.begin();
-                    i != x.end(); ++i)
-            {
-                m_map.insert(
-                        std::make_pair(i->first,
-                                reference_mapped_type<Key, T>(this, i->first,
-                                        i->second)));
-                m_index.insert(std::make_pair(i->second, i->first));
-            }
+            boost::scoped_ptr<garbage> loaded(new garbage);
+            build(x.begin(), x.end(), loaded->m_map, loaded->m_index);
+            replace(*loaded);
             return *this;
         }
-        //оператор копирования из mapi
+        //оператор копирования из mapi, x блокируется на время копирования
         mapi&
         operator=(const mapi& x)
         {
-            boost::mutex::scoped_lock lock(m_mutex);
-            if( this != &x )
+            if( this == &x )
+                return *this;
+            boost::scoped_ptr<garbage> loaded(new garbage);
             {
-                m_map.clear();
-                m_index.clear();
-                for (const_iterator i = x.begin(); i != x.end(); ++i)
-                {
-                    m_map.insert(
-                            std::make_pair(i->first,
-                                    reference_mapped_type<Key, T>(this,
-                                            i->first, i->second)));
-                    m_index.insert(std::make_pair(i->second, i->first));
-                }
+                boost::mutex::scoped_lock lock(x.m_mutex);
+                build(x.m_map.begin(), x.m_map.end(), loaded->m_map,
+                        loaded->m_index);
             }
+            replace(*loaded);
             return *this;
         }
         //вставка значения
         std::pair<iterator, bool>
         insert(const std::pair<Key, T>& x)
         {
+            trace(mapi_trace_insert, x.first, x.second);
             boost::mutex::scoped_lock lock(m_mutex);
-            std::pair<iterator, bool> pair_ib = m_map.insert(
-                    std::make_pair(x.first,
-                            reference_mapped_type<Key, T>(this, x.first,
-                                    x.second)));
-            if( pair_ib.second )
-                m_index.insert(std::make_pair(x.second, x.first));
-            return pair_ib;
+            mapi_read_gate::writer gate(readgate());
+            return add(x.first, x.second);
         }
         //вставка значения с указанием подсказывающего (hint) итератора
         iterator
         insert(iterator position, const std::pair<Key, T>& x)
         {
+            trace(mapi_trace_insert, x.first, x.second);
             boost::mutex::scoped_lock lock(m_mutex);
-            if( m_map.find(x.first) == m_map.end() )
-                m_index.insert(std::make_pair(x.second, x.first));
-            return m_map.insert(position,
-                    std::make_pair(x.first,
-                            reference_mapped_type<Key, T>(this, x.first,
-                                    x.second)));
+            mapi_read_gate::writer gate(readgate());
+            return add(position, x.first, x.second);
         }
         //вставка из диапазона итераторов
         template<typename InputIterator>
@@ -269,16 +419,9 @@ template<typename Key, typename T>
             insert(InputIterator first, InputIterator last)
             {
                 boost::mutex::scoped_lock lock(m_mutex);
+                mapi_read_gate::writer gate(readgate());
                 for (; first != last; ++first)
-                {
-                    std::pair<iterator, bool> pair_ib = m_map.insert(
-                            std::make_pair(first->first,
-                                    reference_mapped_type<Key, T>(this,
-                                            first->first, first->second)));
-                    if( pair_ib.second )
-                        m_index.insert(
-                                std::make_pair(first->second, first->first));
-                }
+                    add(first->first, first->second);
             }
         //итератор начала
         iterator
@@ -309,84 +452,724 @@ template<typename Key, typename T>
         erase(iterator position)
         {
             boost::mutex::scoped_lock lock(m_mutex);
+            mapi_read_gate::writer gate(readgate());
+            record(mapi_change_erase, position->first,
+                    position->second.m_value, T());
+            delkey(position);
             delindex(position);
             m_map.erase(position);
         }
+        //извлечение элемента по итератору, элемент удаляется из mapi, но его память сохраняется в узле
+        node_type
+        extract(iterator position)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            mapi_read_gate::writer gate(readgate());
+            node_type n;
+            unlink(position, n);
+            return n;
+        }
+        //извлечение по ключу, при отсутствии ключа возвращается пустой узел
+        node_type
+        extract(const Key& x)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            mapi_read_gate::writer gate(readgate());
+            node_type n;
+            iterator i = m_map.find(x);
+            if( i != m_map.end() )
+                unlink(i, n);
+            return n;
+        }
+        //вставка извлеченного узла. Если ключ уже есть, узел остается в n, и возвращается
+        //(итератор на имеющийся элемент, false)
+        std::pair<iterator, bool>
+        insert(node_type&& n)
+        {
+            if( n.empty() )
+                return std::make_pair(m_map.end(), false);
+            m_index.check(n.value());
+            boost::mutex::scoped_lock lock(m_mutex);
+            mapi_read_gate::writer gate(readgate());
+            typename map::insert_return_type r = m_map.insert(
+                    std::move(n.m_node));
+            if( !r.inserted )
+            {
+                n.m_node = std::move(r.node);
+                return std::make_pair(r.position, false);
+            }
+            link(r.position, n.m_index_node);
+            return std::make_pair(r.position, true);
+        }
+        //перенос из x всех элементов, ключей которых нет в *this, элементы с имеющимися ключами
+        //остаются в x
+        void
+        merge(mapi& x)
+        {
+            if( this == &x )
+                return;
+            boost::lock(m_mutex, x.m_mutex);
+            boost::mutex::scoped_lock lock(m_mutex, boost::adopt_lock);
+            boost::mutex::scoped_lock xlock(x.m_mutex, boost::adopt_lock);
+            mapi_read_gate::writer gate(readgate()), xgate(x.readgate());
+            splicerange(x, x.m_map.begin(), x.m_map.end());
+        }
+        //то же для диапазона [first, last) элементов x
+        void
+        splice(mapi& x, iterator first, iterator last)
+        {
+            if( this == &x )
+                return;
+            boost::lock(m_mutex, x.m_mutex);
+            boost::mutex::scoped_lock lock(m_mutex, boost::adopt_lock);
+            boost::mutex::scoped_lock xlock(x.m_mutex, boost::adopt_lock);
+            mapi_read_gate::writer gate(readgate()), xgate(x.readgate());
+            splicerange(x, first, last);
+        }
         //удаление по значению
         size_type
         erase(const Key& x)
         {
+            trace(mapi_trace_erase, x, T());
             boost::mutex::scoped_lock lock(m_mutex);
+            mapi_read_gate::writer gate(readgate());
             iterator i = m_map.find(x);
+            if( i == m_map.end() )
+                return 0;
+            record(mapi_change_erase, x, i->second.m_value, T());
+            delkey(i);
             delindex(i);
-            return m_map.erase(x);
+            m_map.erase(i);
+            return 1;
         }
         //удаление по диапазону итераторов
         void
         erase(iterator first, iterator last)
         {
+            std::unique_ptr<garbage> g(new garbage);
+            boost::shared_ptr<mapi_reclaimer> r;
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                mapi_read_gate::writer gate(readgate());
+                r = m_reclaimer;
+                if( first == m_map.begin() && last == m_map.end() )
+                {
+                    detach(g.get());
+                    renewfilters(g.get());
+                    record(mapi_change_clear, Key(), T(), T());
+                }
+                else
+                    while (first != last)
+                    {
+                        iterator i = first++;
+                        record(mapi_change_erase, i->first, i->second.m_value,
+                                T());
+                        delkey(i);
+                        g->m_index_nodes.push_back(
+                                typename index_type::node_type());
+                        delindex(i, &g->m_index_nodes.back());
+                        g->m_nodes.push_back(m_map.extract(i));
+                    }
+            }
+            dispose(g.release(), r);
+        }
+        //элементы с ключами, начинающимися с prefix, в порядке ключей
+        std::vector<iterator>
+        find_prefix(const Key& prefix)
+        {
+            std::vector<iterator> vec;
+            boost::mutex::scoped_lock lock(m_mutex);
+            iterator first, last;
+            prefixrange(m_map, prefix, first, last);
+            for (; first != last; ++first)
+                vec.push_back(first);
+            refer(vec);
+            return vec;
+        }
+        //константный вариант
+        std::vector<const_iterator>
+        find_prefix(const Key& prefix) const
+        {
+            std::vector<const_iterator> vec;
             boost::mutex::scoped_lock lock(m_mutex);
-            for (iterator i = first; i != last; ++i)
-                delindex(i);
-            m_map.erase(first, last);
+            const_iterator first, last;
+            prefixrange(m_map, prefix, first, last);
+            for (; first != last; ++first)
+                vec.push_back(first);
+            refer(vec);
+            return vec;
+        }
+        //удаление элементов с ключами, начинающимися с prefix, возвращает число удаленных. Если
+        //удаляется больше половины элементов, индекс не правится поэлементно, а строится заново
+        //по оставшимся. Память освобождается после снятия блокировки, как в clear()
+        size_type
+        erase_prefix(const Key& prefix)
+        {
+            std::unique_ptr<garbage> g(new garbage);
+            boost::shared_ptr<mapi_reclaimer> r;
+            size_type n = 0;
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                mapi_read_gate::writer gate(readgate());
+                r = m_reclaimer;
+                iterator first, last;
+                prefixrange(m_map, prefix, first, last);
+                n = std::distance(first, last);
+                bool bulk = n > m_map.size() / 2;
+                if( bulk )
+                    m_index.swap(g->m_index);
+                while (first != last)
+                {
+                    iterator i = first++;
+                    record(mapi_change_erase, i->first, i->second.m_value, T());
+                    delkey(i);
+                    if( !bulk )
+                    {
+                        g->m_index_nodes.push_back(
+                                typename index_type::node_type());
+                        delindex(i, &g->m_index_nodes.back());
+                    }
+                    g->m_nodes.push_back(m_map.extract(i));
+                }
+                if( bulk )
+                {
+                    m_index.build(m_map.begin(), m_map.end());
+                    m_bitmaps.clear();
+                    fillbitmaps();
+                    // фильтр читается без блокировки, поэтому не очищается, а из него
+                    // удаляются только исчезнувшие значения, каждое один раз
+                    value_filter* vf = m_vfilter.load(
+                            boost::memory_order_relaxed);
+                    if( vf )
+                    {
+                        std::vector<T> values;
+                        for (std::size_t k = 0; k < g->m_nodes.size(); ++k)
+                            values.push_back(g->m_nodes[k].mapped().m_value);
+                        std::sort(values.begin(), values.end());
+                        values.erase(std::unique(values.begin(), values.end()),
+                                values.end());
+                        for (std::size_t k = 0; k < values.size(); ++k)
+                            if( !m_index.contains(values[k]) )
+                                vf->erase(values[k]);
+                    }
+                }
+            }
+            dispose(g.release(), r);
+            return n;
         }
         //поиск по значению
         std::vector<iterator>
         findv(const T& v)
         {
-            boost::mutex::scoped_lock lock(m_mutex);
-            pair_index_iterator pairi = m_index.equal_range(v);
+            trace(mapi_trace_findv, Key(), v);
             std::vector<iterator> vec;
-            for (; pairi.first != pairi.second; ++pairi.first)
-                vec.push_back(m_map.find(pairi.first->second));
+            bool filtered = false;
+            if( !maybevalue(v, &filtered) )
+                return vec;
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_index.find(v, m_map, vec);
+            refer(vec);
+            value_filter* vf = m_vfilter.load(boost::memory_order_relaxed);
+            if( vf && filtered )
+                vf->record(!vec.empty());
             return vec;
         }
         //константный поиск по значению
         std::vector<const_iterator>
         findv(const T& v) const
         {
+            trace(mapi_trace_findv, Key(), v);
+            std::vector<const_iterator> vec;
+            bool filtered = false;
+            if( !maybevalue(v, &filtered) )
+                return vec;
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_index.find(v, m_map, vec);
+            refer(vec);
+            value_filter* vf = m_vfilter.load(boost::memory_order_relaxed);
+            if( vf && filtered )
+                vf->record(!vec.empty());
+            return vec;
+        }
+        //обход всех элементов вызовом fn(ключ, значение) частями по chunk элементов. Часть копируется
+        //под блокировкой, fn вызывается для копий без блокировки и может обращаться к этому mapi.
+        //Элементы, вставленные или удаленные во время обхода, могут как попасть в обход, так и нет,
+        //остальные обрабатываются ровно один раз со значением на момент копирования части
+        template<typename Function>
+            Function
+            for_each(Function fn, size_type chunk = 1024) const
+            {
+                scan(fn, 0, 0, chunk);
+                return fn;
+            }
+        //то же в threads потоках, каждый обходит свой диапазон ключей своей копией fn. Копии
+        //возвращаются для объединения результатов
+        template<typename Function>
+            std::vector<Function>
+            parallel_for_each(Function fn, unsigned threads,
+                    size_type chunk = 1024) const
+            {
+                std::vector<Key> keys;
+                {
+                    boost::mutex::scoped_lock lock(m_mutex);
+                    std::vector<const_iterator> bounds;
+                    split(threads, bounds);
+                    for (std::size_t t = 1; t + 1 < bounds.size(); ++t)
+                        keys.push_back(bounds[t]->first);
+                }
+                std::vector<Function> fns(keys.size() + 1, fn);
+                boost::thread_group scanners;
+                for (std::size_t t = 0; t < fns.size(); ++t)
+                    scanners.create_thread(
+                            boost::bind(&mapi::template scan<Function>, this,
+                                    boost::ref(fns[t]),
+                                    t ? &keys[t - 1] : 0,
+                                    t < keys.size() ? &keys[t] : 0, chunk));
+                scanners.join_all();
+                return fns;
+            }
+        //следующая страница обхода в порядке значений, не более n элементов, позиция c сдвигается
+        std::vector<iterator>
+        next_page(mapi_cursor<Key, T>& c, size_type n)
+        {
+            std::vector<iterator> vec;
+            boost::mutex::scoped_lock lock(m_mutex);
+            page(c, n, m_map, vec);
+            refer(vec);
+            return vec;
+        }
+        //константный вариант
+        std::vector<const_iterator>
+        next_page(mapi_cursor<Key, T>& c, size_type n) const
+        {
+            std::vector<const_iterator> vec;
+            boost::mutex::scoped_lock lock(m_mutex);
+            page(c, n, m_map, vec);
+            refer(vec);
+            return vec;
+        }
+        //n элементов с наибольшими значениями, по убыванию
+        std::vector<iterator>
+        top_k(size_type n)
+        {
+            std::vector<iterator> vec;
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_index.last(n, m_map, vec);
+            refer(vec);
+            return vec;
+        }
+        std::vector<const_iterator>
+        top_k(size_type n) const
+        {
+            std::vector<const_iterator> vec;
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_index.last(n, m_map, vec);
+            refer(vec);
+            return vec;
+        }
+        //n элементов с наименьшими значениями, по возрастанию
+        std::vector<iterator>
+        bottom_k(size_type n)
+        {
+            std::vector<iterator> vec;
             boost::mutex::scoped_lock lock(m_mutex);
-            pair_index_const_iterator pairi = m_index.equal_range(v);
+            m_index.next(0, 0, n, m_map, vec);
+            refer(vec);
+            return vec;
+        }
+        std::vector<const_iterator>
+        bottom_k(size_type n) const
+        {
             std::vector<const_iterator> vec;
-            for (; pairi.first != pairi.second; ++pairi.first)
-                vec.push_back(m_map.find(pairi.first->second));
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_index.next(0, 0, n, m_map, vec);
+            refer(vec);
             return vec;
         }
+        //количество элементов с заданным значением
+        size_type
+        countv(const T& v) const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            return m_index.count(v);
+        }
+        //включение битового индекса по пространству ключей space
+        void
+        enable_bitmap(const boost::shared_ptr<mapi_key_space<Key> >& space)
+        {
+            assert(space);
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_bitmaps.clear();
+            m_space = space;
+            fillbitmaps();
+        }
+        //пространство ключей битового индекса, пустой указатель если индекс не включен
+        boost::shared_ptr<mapi_key_space<Key> >
+        key_space() const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            return m_space;
+        }
+        //битовая карта ключей со значением v
+        mapi_bitmap
+        bitmap(const T& v) const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            if( !m_space )
+                throw std::logic_error("mapi: bitmap index is not enabled");
+            typename bitmaps::const_iterator i = m_bitmaps.find(v);
+            return i == m_bitmaps.end() ? mapi_bitmap() : i->second;
+        }
+        //битовая карта ключей со значениями из диапазона [first, last)
+        template<typename InputIterator>
+            mapi_bitmap
+            bitmap_any(InputIterator first, InputIterator last) const
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                if( !m_space )
+                    throw std::logic_error("mapi: bitmap index is not enabled");
+                return unite(first, last);
+            }
+        //поиск по множеству значений [first, last), порядок результата не определен
+        template<typename InputIterator>
+            std::vector<iterator>
+            findv_any(InputIterator first, InputIterator last)
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                std::vector<iterator> vec;
+                findany(first, last, m_map, vec);
+                refer(vec);
+                return vec;
+            }
+        //константный поиск по множеству значений
+        template<typename InputIterator>
+            std::vector<const_iterator>
+            findv_any(InputIterator first, InputIterator last) const
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                std::vector<const_iterator> vec;
+                findany(first, last, m_map, vec);
+                refer(vec);
+                return vec;
+            }
+        //количество элементов со значениями из диапазона [first, last)
+        template<typename InputIterator>
+            size_type
+            countv_any(InputIterator first, InputIterator last) const
+            {
+                std::vector<T> values(first, last);
+                std::sort(values.begin(), values.end());
+                values.erase(std::unique(values.begin(), values.end()),
+                        values.end());
+                boost::mutex::scoped_lock lock(m_mutex);
+                size_type n = 0;
+                for (typename std::vector<T>::const_iterator i = values.begin();
+                        i != values.end(); ++i)
+                    n += m_index.count(*i);
+                return n;
+            }
         //поиск по ключу
         iterator
         find(const key_type& x)
         {
+            trace(mapi_trace_find, x, T());
+            bool filtered = false;
+            if( !maybekey(x, &filtered) )
+            {
+                touch(0);
+                return m_map.end();
+            }
             boost::mutex::scoped_lock lock(m_mutex);
-            return m_map.find(x);
+            iterator i = m_map.find(x);
+            key_filter* kf = m_kfilter.load(boost::memory_order_relaxed);
+            if( kf && filtered )
+                kf->record(i != m_map.end());
+            touch(i == m_map.end() ? 0 : &i->first);
+            return i;
         }
         //константный поиск по ключу
         const_iterator
         find(const key_type& x) const
         {
+            trace(mapi_trace_find, x, T());
+            bool filtered = false;
+            if( !maybekey(x, &filtered) )
+            {
+                touch(0);
+                return m_map.end();
+            }
+            boost::mutex::scoped_lock lock(m_mutex);
+            const_iterator i = m_map.find(x);
+            key_filter* kf = m_kfilter.load(boost::memory_order_relaxed);
+            if( kf && filtered )
+                kf->record(i != m_map.end());
+            touch(i == m_map.end() ? 0 : &i->first);
+            return i;
+        }
+        //копия значения по ключу без захвата блокировки, если параллельно не идет изменение
+        std::optional<T>
+        get(const key_type& x) const
+        {
+            trace(mapi_trace_get, x, T());
+            if( !maybekey(x) )
+            {
+                touch(0);
+                return std::nullopt;
+            }
+            mapi_read_gate *g = readgate();
+            if( !g )
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                g = opengate();
+            }
+            {
+                mapi_read_gate::reader reader(g);
+                if( reader )
+                    return lookup(x);
+            }
+            boost::mutex::scoped_lock lock(m_mutex);
+            return lookup(x);
+        }
+        //включение фильтров Блума, expected_keys и expected_values - ожидаемое число ключей
+        //и различных значений, для нулевого числа фильтр не создается. Повторный вызов не допускается.
+        void
+        enable_filter(size_type expected_keys, size_type expected_values)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            assert(!m_kfilter.load() && !m_vfilter.load());
+            key_filter *kf = expected_keys ? new key_filter(expected_keys) : 0;
+            value_filter *vf =
+                    expected_values ? new value_filter(expected_values) : 0;
+            fillfilters(kf, vf);
+            opengate();
+            m_kfilter.store(kf, boost::memory_order_release);
+            m_vfilter.store(vf, boost::memory_order_release);
+        }
+        //статистика фильтра ключей
+        mapi_filter_stats
+        key_filter_stats() const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            key_filter* kf = m_kfilter.load(boost::memory_order_relaxed);
+            return kf ? kf->stats() : mapi_filter_stats();
+        }
+        //статистика фильтра значений
+        mapi_filter_stats
+        value_filter_stats() const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            value_filter* vf = m_vfilter.load(boost::memory_order_relaxed);
+            return vf ? vf->stats() : mapi_filter_stats();
+        }
+        //поиск по набору ключей, vec[i] - результат поиска keys[i]
+        void
+        find_many(const std::vector<Key>& keys, std::vector<iterator>& vec)
+        {
+            std::vector<std::size_t> order;
+            mapi_sort_order(keys, order);
+            boost::mutex::scoped_lock lock(m_mutex);
+            findmany(keys, order, m_map, vec);
+            for (std::size_t k = 0; k < vec.size(); ++k)
+                touch(vec[k] == m_map.end() ? 0 : &vec[k]->first);
+        }
+        //константный поиск по набору ключей
+        void
+        find_many(const std::vector<Key>& keys,
+                std::vector<const_iterator>& vec) const
+        {
+            std::vector<std::size_t> order;
+            mapi_sort_order(keys, order);
+            boost::mutex::scoped_lock lock(m_mutex);
+            findmany(keys, order, m_map, vec);
+            for (std::size_t k = 0; k < vec.size(); ++k)
+                touch(vec[k] == m_map.end() ? 0 : &vec[k]->first);
+        }
+        //поиск по набору значений, vecs[i] - результат поиска values[i]
+        void
+        findv_many(const std::vector<T>& values,
+                std::vector<std::vector<iterator> >& vecs)
+        {
+            std::vector<std::size_t> order;
+            mapi_sort_order(values, order);
+            clearmany(values.size(), vecs);
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_index.find_many(values, order, m_map, vecs);
+            for (std::size_t k = 0; k < vecs.size(); ++k)
+                refer(vecs[k]);
+        }
+        //константный поиск по набору значений
+        void
+        findv_many(const std::vector<T>& values,
+                std::vector<std::vector<const_iterator> >& vecs) const
+        {
+            std::vector<std::size_t> order;
+            mapi_sort_order(values, order);
+            clearmany(values.size(), vecs);
             boost::mutex::scoped_lock lock(m_mutex);
-            return m_map.find(x);
+            m_index.find_many(values, order, m_map, vecs);
+            for (std::size_t k = 0; k < vecs.size(); ++k)
+                refer(vecs[k]);
         }
         //операция индексации
         mapped_type&
         operator[](const key_type& k)
         {
+            trace(mapi_trace_subscript, k, T());
             boost::mutex::scoped_lock lock(m_mutex);
-            if( m_map.find(k) == m_map.end() )
-            {
-                m_map.insert(
-                        std::make_pair(k,
-                                reference_mapped_type<Key, T>(this, k, T())));
-                m_index.insert(std::make_pair(T(), k));
-            }
-            return m_map[k];
+            mapi_read_gate::writer gate(readgate());
+            std::pair<iterator, bool> pair_ib = add(k, T());
+            if( !pair_ib.second )
+                touch(&pair_ib.first->first);
+            return pair_ib.first->second;
         }
         //очистка
         void
         clear()
+        {
+            trace(mapi_trace_clear, Key(), T());
+            std::unique_ptr<garbage> g(new garbage);
+            boost::shared_ptr<mapi_reclaimer> r;
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                mapi_read_gate::writer gate(readgate());
+                r = m_reclaimer;
+                detach(g.get());
+                renewfilters(g.get());
+                record(mapi_change_clear, Key(), T(), T());
+            }
+            dispose(g.release(), r);
+        }
+        //задание потока удаления для clear() и erase(first, last), пустой указатель - удаление
+        //в вызывающем потоке после снятия блокировки
+        void
+        set_reclaimer(const boost::shared_ptr<mapi_reclaimer>& r)
         {
             boost::mutex::scoped_lock lock(m_mutex);
-            m_map.clear();
-            m_index.clear();
+            m_reclaimer = r;
+        }
+        //ограничение числа элементов емкостью n с вытеснением по алгоритму CLOCK, 0 - без ограничения.
+        //Если элементов больше n, лишние вытесняются сразу. Кольцо CLOCK и счетчики поисков создаются
+        //при первом задании емкости, при n = 0 кольцо удаляется
+        void
+        set_capacity(size_type n)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            mapi_read_gate::writer gate(readgate());
+            m_capacity.store(n, boost::memory_order_relaxed);
+            if( !n )
+            {
+                m_ring.reset();
+                return;
+            }
+            if( !m_lookups.load(boost::memory_order_relaxed) )
+                m_lookups.store(new mapi_hit_counter,
+                        boost::memory_order_release);
+            m_ring.reset(new clock_ring);
+            for (iterator i = m_map.begin(); i != m_map.end(); ++i)
+                m_ring->add(i);
+            evict(m_map.end());
+        }
+        size_type
+        capacity() const
+        {
+            return m_capacity.load(boost::memory_order_relaxed);
+        }
+        //счетчики режима ограниченной емкости, ведутся только при ненулевой емкости
+        mapi_cache_stats
+        cache_stats() const
+        {
+            mapi_cache_stats st;
+            mapi_hit_counter *c = m_lookups.load(boost::memory_order_acquire);
+            if( c )
+            {
+                st.hits = c->hits();
+                st.misses = c->misses();
+            }
+            st.evictions = m_evictions.load(boost::memory_order_relaxed);
+            return st;
+        }
+        //подключение журнала изменений, пустой указатель - отключение
+        void
+        set_feed(const boost::shared_ptr<mapi_feed<Key, T> >& feed)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_feed = feed;
+        }
+        //подключение записи трассы, существующие элементы записываются как mapi_trace_preload.
+        //Повторный вызов не допускается, запись прекращается mapi_recorder::stop()
+        void
+        set_recorder(const boost::shared_ptr<mapi_recorder>& r)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            assert(r && !m_recorder);
+            for (iterator i = m_map.begin(); i != m_map.end(); ++i)
+                r->record(mapi_trace_preload, i->first, i->second.m_value);
+            m_recorder = r;
+            m_trace.store(r.get(), boost::memory_order_release);
+        }
+        //копия содержимого в x и номер следующей записи журнала изменений, согласованный с копией
+        boost::uint64_t
+        snapshot(std::map<Key, T>& x) const
+        {
+            x.clear();
+            boost::mutex::scoped_lock lock(m_mutex);
+            for (const_iterator i = m_map.begin(); i != m_map.end(); ++i)
+                x.insert(x.end(), std::make_pair(i->first, i->second.m_value));
+            return m_feed ? m_feed->next() : 0;
+        }
+        //двоичная запись в поток os, формат см. mapi_serialize.h
+        void
+        serialize(std::ostream& os) const
+        {
+            mapi_writer w(os);
+            boost::mutex::scoped_lock lock(m_mutex);
+            boost::uint64_t n = m_map.size();
+            w.write(&mapi_serial_magic, sizeof(mapi_serial_magic));
+            w.write(&mapi_serial_version, sizeof(mapi_serial_version));
+            w.write(&n, sizeof(n));
+            for (const_iterator i = m_map.begin(); i != m_map.end(); ++i)
+            {
+                mapi_serializer<Key>::write(w, i->first);
+                mapi_serializer<T>::write(w, i->second.m_value);
+            }
+            w.flush();
+        }
+        //замена содержимого данными, записанными serialize. Чтение, построение индекса, битового
+        //индекса, фильтров и кольца CLOCK выполняются без блокировки, под блокировкой содержимое
+        //только подменяется и вытесняются элементы сверх емкости. В журнал изменений пишется одна
+        //запись mapi_change_reload. При ошибке бросается
+        //std::runtime_error (std::out_of_range для недопустимого значения плотного индекса),
+        //содержимое в этом случае не меняется
+        void
+        deserialize(std::istream& is)
+        {
+            mapi_reader r(is);
+            boost::uint32_t magic, version;
+            boost::uint64_t n;
+            r.read(&magic, sizeof(magic));
+            if( magic != mapi_serial_magic )
+                throw std::runtime_error("mapi: not a serialized mapi");
+            r.read(&version, sizeof(version));
+            if( version != mapi_serial_version )
+                throw std::runtime_error("mapi: unsupported format version");
+            r.read(&n, sizeof(n));
+            boost::scoped_ptr<garbage> loaded(new garbage);
+            Key k;
+            T v;
+            for (boost::uint64_t j = 0; j < n; ++j)
+            {
+                mapi_serializer<Key>::read(r, k);
+                mapi_serializer<T>::read(r, v);
+                m_index.check(v);
+                if( j && !(loaded->m_map.rbegin()->first < k) )
+                    throw std::runtime_error("mapi: keys out of order");
+                iterator i = loaded->m_map.insert(loaded->m_map.end(),
+                        std::make_pair(std::move(k),
+                                reference_mapped_type<Key, T>(this, v)));
+                i->second.m_key = &i->first;
+            }
+            loaded->m_index.build(loaded->m_map.begin(), loaded->m_map.end());
+            replace(*loaded);
         }
         //проверка на пустоту
         bool
@@ -404,49 +1187,889 @@ template<typename Key, typename T>
         bool
         validate() const
         {
-            boost::mutex::scoped_lock lock(m_mutex);
-            if( m_map.size() != m_index.size() )
-                return false;
-            for (const_iterator i = m_map.begin(); i != m_map.end(); ++i)
+            return validate(1);
+        }
+        //проверка индекса в threads потоках. Под блокировкой снимается копия: адреса ключей в узлах
+        //и значения основного хранилища и индекса, а при битовом индексе также ключи и битовые карты.
+        //Сравнение копий, сортировка и поиск номеров ключей выполняются после снятия блокировки,
+        //поэтому проверка задерживает читателей и писателей только на время копирования
+        bool
+        validate(unsigned threads) const
+        {
+            std::vector<element> elements, entries;
+            std::vector<Key> keys;
+            bitmaps maps;
+            boost::shared_ptr<mapi_key_space<Key> > space;
             {
-                pair_index_const_iterator pairci = m_index.equal_range(
-                        i->second);
-                int count = 0;
-                for (index_const_iterator j = pairci.first; j != pairci.second;
-                        ++j)
+                boost::mutex::scoped_lock lock(m_mutex);
+                elements.reserve(m_map.size());
+                for (const_iterator i = m_map.begin(); i != m_map.end(); ++i)
+                    elements.push_back(element(&i->first, i->second.m_value));
+                m_index.copy(entries);
+                space = m_space;
+                if( space )
                 {
-                    if( j->second == i->first )
-                        ++count;
+                    keys.reserve(m_map.size());
+                    for (const_iterator i = m_map.begin(); i != m_map.end();
+                            ++i)
+                        keys.push_back(i->first);
+                    maps = m_bitmaps;
                 }
-                if( count != 1 )
+            }
+            if( elements.size() != entries.size() )
+                return false;
+            if( space )
+            {
+                size_type n = 0;
+                for (typename bitmaps::const_iterator i = maps.begin();
+                        i != maps.end(); ++i)
+                    n += i->second.cardinality();
+                if( n != elements.size() )
+                    return false;
+                if( !threads )
+                    threads = 1;
+                // char вместо bool, чтобы потоки не писали в одно слово vector<bool>
+                std::vector<char> results(threads, 0);
+                boost::thread_group checkers;
+                for (std::size_t t = 0; t < threads; ++t)
+                    checkers.create_thread(
+                            boost::bind(&mapi::checkbitmaps, boost::cref(*space),
+                                    boost::cref(keys), boost::cref(elements),
+                                    boost::cref(maps),
+                                    keys.size() * t / threads,
+                                    keys.size() * (t + 1) / threads,
+                                    &results[t]));
+                checkers.join_all();
+                if( std::find(results.begin(), results.end(), 0)
+                        != results.end() )
                     return false;
             }
+            // адреса ключей в основном хранилище различны, поэтому после сортировки по адресу
+            // копии совпадают, только если индекс содержит каждый элемент ровно один раз
+            mapi_parallel_sort(elements, element_less(), threads);
+            mapi_parallel_sort(entries, element_less(), threads);
+            for (std::size_t k = 0; k < elements.size(); ++k)
+                if( elements[k].first != entries[k].first
+                        || elements[k].second != entries[k].second )
+                    return false;
             return true;
         }
+        //перестроение индекса по основному хранилищу, сортировка выполняется в threads потоках
+        void
+        rebuild_index(unsigned threads = 1)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_index.clear();
+            m_index.build(m_map.begin(), m_map.end(), threads);
+            m_bitmaps.clear();
+            fillbitmaps();
+        }
     private:
+        //тип битового индекса
+        typedef std::map<T, mapi_bitmap> bitmaps;
+        //тип фильтра ключей
+        typedef mapi_filter<Key> key_filter;
+        //тип фильтра значений
+        typedef mapi_filter<T> value_filter;
+        //элемент копии для проверки: адрес ключа в узле основного хранилища и значение
+        typedef std::pair<const Key*, T> element;
+        struct element_less
+        {
+            bool
+            operator()(const element& a, const element& b) const
+            {
+                return std::less<const Key*>()(a.first, b.first);
+            }
+        };
+        //кольцо CLOCK режима ограниченной емкости: элементы основного хранилища с битами обращения
+        //и стрелка. Позиция элемента в кольце находится по адресу его ключа в узле основного
+        //хранилища, поэтому сами элементы ничего для CLOCK не хранят
+        struct clock_ring
+        {
+            //элемент кольца, бит обращения выставляется при поиске без исключительной блокировки
+            struct slot
+            {
+                explicit
+                slot(iterator i) :
+                        m_item(i), m_referenced(true)
+                {
+                }
+                slot(const slot& x) :
+                        m_item(x.m_item), m_referenced(
+                                x.m_referenced.load(boost::memory_order_relaxed))
+                {
+                }
+                slot&
+                operator=(const slot& x)
+                {
+                    m_item = x.m_item;
+                    m_referenced.store(
+                            x.m_referenced.load(boost::memory_order_relaxed),
+                            boost::memory_order_relaxed);
+                    return *this;
+                }
+                iterator m_item;
+                mutable boost::atomic<bool> m_referenced;
+            };
+            clock_ring() :
+                    m_hand(0)
+            {
+            }
+            void
+            add(iterator i)
+            {
+                m_positions[&i->first] = m_slots.size();
+                m_slots.push_back(slot(i));
+            }
+            void
+            clear()
+            {
+                m_slots.clear();
+                m_positions.clear();
+                m_hand = 0;
+            }
+            //удаление за O(1): на место удаленного встает последний элемент кольца
+            void
+            remove(iterator i)
+            {
+                typename positions::iterator p = m_positions.find(&i->first);
+                assert(p != m_positions.end() && m_slots[p->second].m_item == i);
+                // срабатывание, означает ошибку в программе
+                std::size_t pos = p->second;
+                m_positions.erase(p);
+                if( pos + 1 != m_slots.size() )
+                {
+                    m_slots[pos] = m_slots.back();
+                    m_positions[&m_slots[pos].m_item->first] = pos;
+                }
+                m_slots.pop_back();
+            }
+            //выставление бита обращения элемента с ключом k, если он в кольце. Бит проверяется перед
+            //записью, чтобы повторные обращения не записывали в строку кэша кольца
+            void
+            touch(const Key *k) const
+            {
+                typename positions::const_iterator p = m_positions.find(k);
+                if( p == m_positions.end() )
+                    return;
+                const slot& e = m_slots[p->second];
+                if( !e.m_referenced.load(boost::memory_order_relaxed) )
+                    e.m_referenced.store(true, boost::memory_order_relaxed);
+            }
+            typedef boost::unordered_map<const Key*, std::size_t> positions;
+            std::vector<slot> m_slots;
+            positions m_positions;
+            std::size_t m_hand;
+        };
+        //отсоединенные от mapi данные, удаляемые вне блокировки
+        struct garbage : mapi_garbage
+        {
+            map m_map;
+            index_type m_index;
+            bitmaps m_bitmaps;
+            std::vector<typename map::node_type> m_nodes;
+            std::vector<typename index_type::node_type> m_index_nodes;
+            std::unique_ptr<key_filter> m_kfilter;
+            std::unique_ptr<value_filter> m_vfilter;
+            boost::scoped_ptr<clock_ring> m_ring;
+        };
         //основное хранилище
         map m_map;
         //индекс
         index_type m_index;
+        //пространство ключей битового индекса
+        boost::shared_ptr<mapi_key_space<Key> > m_space;
+        //битовый индекс, ведется только при наличии m_space
+        bitmaps m_bitmaps;
+        //фильтры Блума, читаются без блокировки
+        boost::atomic<key_filter*> m_kfilter;
+        boost::atomic<value_filter*> m_vfilter;
+        //емкость, 0 - без ограничения
+        boost::atomic<size_type> m_capacity;
+        //счетчики режима ограниченной емкости, создаются при первом задании емкости и сохраняются
+        //до уничтожения mapi, потому что неудачный поиск считается без блокировки
+        boost::atomic<mapi_hit_counter*> m_lookups;
+        boost::atomic<size_type> m_evictions;
+        //кольцо CLOCK, существует только при ненулевой емкости. Меняется под блокировкой и шлюзом
+        //писателя, поэтому get читает его в шлюзе без блокировки
+        boost::scoped_ptr<clock_ring> m_ring;
+        //поток удаления отсоединенных данных
+        boost::shared_ptr<mapi_reclaimer> m_reclaimer;
+        //шлюз читателей get и фильтров, создается при первом вызове get или enable_filter
+        mutable boost::atomic<mapi_read_gate*> m_gate;
+        //журнал изменений
+        boost::shared_ptr<mapi_feed<Key, T> > m_feed;
+        //запись трассы, m_trace читается без блокировки
+        boost::shared_ptr<mapi_recorder> m_recorder;
+        boost::atomic<mapi_recorder*> m_trace;
         mutable boost::mutex m_mutex;
-        //вспомогательный метод удаления из индекса по итератору основного хранилища
+        //вспомогательный метод заполнения пустых основного хранилища m и индекса index элементами
+        //этого mapi в конструкторах и операторах копирования: сначала заполняется основное хранилище,
+        //затем индекс строится целиком по отсортированным значениям
+        template<typename InputIterator>
+            void
+            build(InputIterator first, InputIterator last, map& m,
+                    index_type& index)
+            {
+                for (; first != last; ++first)
+                {
+                    index.check(first->second);
+                    iterator i = m.insert(m.end(),
+                            std::make_pair(first->first,
+                                    reference_mapped_type<Key, T>(this,
+                                            first->second)));
+                    i->second.m_key = &i->first;
+                }
+                index.build(m.begin(), m.end());
+            }
+        //вспомогательный метод вставки в основное хранилище и индекс
+        std::pair<iterator, bool>
+        add(const Key& k, const T& v)
+        {
+            m_index.check(v);
+            std::pair<iterator, bool> pair_ib = m_map.insert(
+                    std::make_pair(k,
+                            reference_mapped_type<Key, T>(this, v)));
+            if( pair_ib.second )
+            {
+                pair_ib.first->second.m_key = &pair_ib.first->first;
+                addindex(pair_ib.first);
+                addkey(pair_ib.first);
+                record(mapi_change_insert, k, T(), v);
+                evict(pair_ib.first);
+            }
+            return pair_ib;
+        }
+        //то же, с указанием подсказывающего (hint) итератора
+        iterator
+        add(iterator position, const Key& k, const T& v)
+        {
+            m_index.check(v);
+            size_type n = m_map.size();
+            iterator i = m_map.insert(position,
+                    std::make_pair(k,
+                            reference_mapped_type<Key, T>(this, v)));
+            if( m_map.size() != n )
+            {
+                i->second.m_key = &i->first;
+                addindex(i);
+                addkey(i);
+                record(mapi_change_insert, k, T(), v);
+                evict(i);
+            }
+            return i;
+        }
+        //вспомогательный метод получения шлюза читателей, нулевой указатель - шлюз еще не создан
+        mapi_read_gate*
+        readgate() const
+        {
+            return m_gate.load(boost::memory_order_acquire);
+        }
+        //вспомогательный метод создания шлюза читателей при первом обращении, вызывается
+        //под блокировкой. Шлюз не удаляется до уничтожения mapi
+        mapi_read_gate*
+        opengate() const
+        {
+            mapi_read_gate *g = m_gate.load(boost::memory_order_relaxed);
+            if( !g )
+            {
+                g = new mapi_read_gate;
+                m_gate.store(g, boost::memory_order_release);
+            }
+            return g;
+        }
+        //вспомогательный метод записи операции в трассу, если она подключена
+        void
+        trace(mapi_trace_op op, const Key& k, const T& v) const
+        {
+            mapi_recorder *r = m_trace.load(boost::memory_order_acquire);
+            if( r )
+                r->record(op, k, v);
+        }
+        //вспомогательный метод изменения значения элемента основного хранилища
         void
-        delindex(iterator i)
+        setvalue(iterator i, const T& v)
+        {
+            m_index.check(v);
+            record(mapi_change_assign, i->first, i->second.m_value, v);
+            delindex(i);
+            i->second.m_value = v;
+            addindex(i);
+        }
+        //вспомогательный метод обхода ключей из [*from, *to) частями по chunk элементов, нулевые
+        //from и to - начало и конец основного хранилища. Часть копируется в буфер потока обхода
+        //под блокировкой, fn вызывается для копии после ее освобождения
+        template<typename Function>
+            void
+            scan(Function& fn, const Key* from, const Key* to,
+                    size_type chunk) const
+            {
+                std::vector<std::pair<Key, T> > buffer;
+                bool done = false;
+                if( !chunk )
+                    chunk = 1;
+                buffer.reserve(chunk);
+                while (!done)
+                {
+                    {
+                        boost::mutex::scoped_lock lock(m_mutex);
+                        const_iterator i =
+                                !buffer.empty() ?
+                                        m_map.upper_bound(buffer.back().first) :
+                                from ? m_map.lower_bound(*from) : m_map.begin();
+                        buffer.clear();
+                        for (; buffer.size() < chunk; ++i)
+                        {
+                            if( i == m_map.end() || (to && !(i->first < *to)) )
+                            {
+                                done = true;
+                                break;
+                            }
+                            buffer.push_back(
+                                    std::make_pair(i->first, i->second.m_value));
+                        }
+                    }
+                    for (std::size_t k = 0; k < buffer.size(); ++k)
+                        fn(buffer[k].first, buffer[k].second);
+                }
+            }
+        //вспомогательный метод поиска значения для get, вызывается под блокировкой или в шлюзе
+        std::optional<T>
+        lookup(const key_type& x) const
+        {
+            const_iterator i = m_map.find(x);
+            if( i == m_map.end() )
+            {
+                touch(0);
+                return std::nullopt;
+            }
+            touch(&i->first);
+            return i->second.m_value;
+        }
+        //вспомогательный метод поиска диапазона [first, last) ключей с префиксом prefix: last - первый
+        //ключ не меньше наименьшей строки, большей всех строк с этим префиксом
+        template<typename Map, typename MapIterator>
+            static void
+            prefixrange(Map& m, const Key& prefix, MapIterator& first,
+                    MapIterator& last)
+            {
+                first = m.lower_bound(prefix);
+                // строки сравниваются как последовательности unsigned char
+                Key next(prefix);
+                while (!next.empty()
+                        && static_cast<unsigned char>(next[next.size() - 1])
+                                == 0xff)
+                    next.erase(next.size() - 1);
+                if( next.empty() )
+                {
+                    last = m.end();
+                    return;
+                }
+                next[next.size() - 1] = static_cast<unsigned char>(next[next.size()
+                        - 1]) + 1;
+                last = m.lower_bound(next);
+            }
+        //вспомогательный метод выдачи страницы обхода, вызывается под блокировкой
+        template<typename Map, typename MapIterator>
+            void
+            page(mapi_cursor<Key, T>& c, size_type n, Map& m,
+                    std::vector<MapIterator>& vec) const
+            {
+                if( c.m_started )
+                    m_index.next(&c.m_value, &c.m_key, n, m, vec);
+                else
+                    m_index.next(0, 0, n, m, vec);
+                if( !vec.empty() )
+                {
+                    c.m_started = true;
+                    c.m_value = vec.back()->second;
+                    c.m_key = vec.back()->first;
+                }
+                c.m_end = vec.size() < n;
+            }
+        //вспомогательный метод извлечения элемента i в n, вызывается под блокировкой
+        void
+        unlink(iterator i, node_type& n)
+        {
+            record(mapi_change_erase, i->first, i->second.m_value, T());
+            delkey(i);
+            delindex(i, &n.m_index_node);
+            n.m_node = m_map.extract(i);
+        }
+        //вспомогательный метод подключения вставленного узла основного хранилища i, index_node -
+        //его узел индекса, вызывается под блокировкой
+        void
+        link(iterator i, typename index_type::node_type& index_node)
+        {
+            i->second.m_mapi = this;
+            addindex(i, &index_node);
+            addkey(i);
+            record(mapi_change_insert, i->first, T(), i->second.m_value);
+            evict(i);
+        }
+        //вспомогательный метод переноса элементов [first, last) из x, вызывается под блокировками
+        //обоих mapi
+        void
+        splicerange(mapi& x, iterator first, iterator last)
+        {
+            node_type n;
+            while (first != last)
+            {
+                iterator i = first++;
+                iterator pos = m_map.lower_bound(i->first);
+                if( pos != m_map.end() && !(i->first < pos->first) )
+                    continue;
+                m_index.check(i->second.m_value);
+                x.unlink(i, n);
+                iterator j = m_map.insert(pos, std::move(n.m_node));
+                link(j, n.m_index_node);
+            }
+        }
+        //вспомогательный метод записи в журнал изменений
+        void
+        record(mapi_change_op op, const Key& k, const T& old_value,
+                const T& new_value)
+        {
+            if( m_feed )
+                m_feed->push(op, k, old_value, new_value);
+        }
+        //вспомогательный метод добавления в индекс по итератору основного хранилища,
+        //при заданном node используется извлеченный ранее узел индекса
+        void
+        addindex(iterator i, typename index_type::node_type *node = 0)
+        {
+            value_filter* vf = m_vfilter.load(boost::memory_order_relaxed);
+            if( vf && !m_index.contains(i->second.m_value) )
+                vf->insert(i->second.m_value);
+            if( node )
+                m_index.insert(*node, i->second.m_value, i);
+            else
+                m_index.insert(i->second.m_value, i);
+            if( m_space )
+                m_bitmaps[i->second.m_value].add(m_space->insert(i->first));
+        }
+        //вспомогательный метод удаления из индекса по итератору основного хранилища,
+        //при заданном node узел индекса не освобождается, а переносится в *node
+        void
+        delindex(iterator i, typename index_type::node_type *node = 0)
+        {
+            if( i == m_map.end() )
+                return;
+            if( node )
+                *node = m_index.extract(i->second.m_value, i);
+            else
+                m_index.erase(i->second.m_value, i);
+            value_filter* vf = m_vfilter.load(boost::memory_order_relaxed);
+            if( vf && !m_index.contains(i->second.m_value) )
+                vf->erase(i->second.m_value);
+            if( m_space )
+            {
+                typename mapi_key_space<Key>::ordinal_type o;
+                typename bitmaps::iterator j = m_bitmaps.find(
+                        i->second.m_value);
+                if( j != m_bitmaps.end() && m_space->find(i->first, o) )
+                {
+                    j->second.remove(o);
+                    if( j->second.empty() )
+                        m_bitmaps.erase(j);
+                }
+            }
+        }
+        //вспомогательный метод пакетного поиска по ключам
+        template<typename Map, typename MapIterator>
+            static void
+            findmany(const std::vector<Key>& keys,
+                    const std::vector<std::size_t>& order, Map& m,
+                    std::vector<MapIterator>& vec)
+            {
+                vec.assign(keys.size(), m.end());
+                MapIterator finger = m.begin();
+                for (std::size_t k = 0; k < order.size(); ++k)
+                {
+                    const Key& key = keys[order[k]];
+                    finger = mapi_finger_lower_bound(m, finger, key);
+                    if( finger != m.end() && !(key < finger->first) )
+                        vec[order[k]] = finger;
+                }
+            }
+        //подготовка буферов пакетного поиска по значениям, память векторов сохраняется
+        template<typename MapIterator>
+            static void
+            clearmany(std::size_t n, std::vector<std::vector<MapIterator> >& vecs)
+            {
+                vecs.resize(n);
+                for (std::size_t k = 0; k < n; ++k)
+                    vecs[k].clear();
+            }
+        //вспомогательный метод добавления ключа в фильтр и кольцо CLOCK, значение ключа фильтр
+        //учитывает отдельно, при изменении значения ключ из фильтра не удаляется
+        void
+        addkey(iterator i)
+        {
+            key_filter* kf = m_kfilter.load(boost::memory_order_relaxed);
+            if( kf )
+                kf->insert(i->first);
+            if( m_ring )
+                m_ring->add(i);
+        }
+        //вспомогательный метод удаления ключа из фильтра и кольца CLOCK
+        void
+        delkey(iterator i)
         {
             if( i == m_map.end() )
                 return;
-            pair_index_iterator pairi = m_index.equal_range(i->second);
-            bool found = false;
-            for (; pairi.first != pairi.second; ++pairi.first)
-                if( pairi.first->second == i->first )
+            key_filter* kf = m_kfilter.load(boost::memory_order_relaxed);
+            if( kf )
+                kf->erase(i->first);
+            if( m_ring )
+                m_ring->remove(i);
+        }
+        //вспомогательный метод вытеснения элементов сверх емкости, кроме только что вставленного
+        //except. Элемент с выставленным битом обращения пропускается со сбросом бита, после двух
+        //полных оборотов (биты могут выставлять параллельные get) вытесняется текущий элемент
+        void
+        evict(iterator except)
+        {
+            size_type capacity = m_capacity.load(boost::memory_order_relaxed);
+            if( !capacity || !m_ring )
+                return;
+            std::vector<typename clock_ring::slot>& slots = m_ring->m_slots;
+            std::size_t& hand = m_ring->m_hand;
+            while (m_map.size() > capacity)
+            {
+                std::size_t steps = 0;
+                for (;; ++hand, ++steps)
                 {
-                    found = true;
-                    break;
+                    if( hand >= slots.size() )
+                        hand = 0;
+                    if( slots[hand].m_item == except )
+                        continue;
+                    if( steps > 2 * slots.size()
+                            || !slots[hand].m_referenced.load(
+                                    boost::memory_order_relaxed) )
+                        break;
+                    slots[hand].m_referenced.store(false,
+                            boost::memory_order_relaxed);
                 }
-            assert(found);
-            // срабатывание, означает ошибку в программе
-            m_index.erase(pairi.first);
+                // на место вытесненного в кольце встает последний элемент, стрелка не сдвигается
+                iterator victim = slots[hand].m_item;
+                record(mapi_change_erase, victim->first,
+                        victim->second.m_value, T());
+                delkey(victim);
+                delindex(victim);
+                m_map.erase(victim);
+                m_evictions.fetch_add(1, boost::memory_order_relaxed);
+            }
+        }
+        //вспомогательный метод учета поиска по ключу, k - ключ найденного элемента в узле основного
+        //хранилища, нулевой k - неудачный поиск. Неудачный поиск может учитываться без блокировки,
+        //удачный - под блокировкой или в шлюзе читателей, когда кольцо не может быть заменено
+        void
+        touch(const Key *k) const
+        {
+            if( !m_capacity.load(boost::memory_order_relaxed) )
+                return;
+            mapi_hit_counter *c = m_lookups.load(boost::memory_order_acquire);
+            if( !k )
+            {
+                if( c )
+                    c->miss();
+                return;
+            }
+            if( c )
+                c->hit();
+            if( m_ring )
+                m_ring->touch(k);
         }
+        //вспомогательный метод выставления битов обращения элементов vec, найденных под блокировкой
+        //не по ключу. В статистике поисков не учитывается
+        template<typename Iterator>
+            void
+            refer(const std::vector<Iterator>& vec) const
+            {
+                if( !m_ring )
+                    return;
+                for (typename std::vector<Iterator>::const_iterator i =
+                        vec.begin(); i != vec.end(); ++i)
+                    m_ring->touch(&(*i)->first);
+            }
+        //вспомогательный метод проверки ключа фильтром без блокировки, false - ключа точно нет.
+        //Фильтр читается внутри шлюза читателей, поэтому не может быть подменен и удален во время
+        //проверки. Если идет изменение, фильтр не используется. В *consulted записывается true,
+        //если ответ "возможно есть" дал фильтр, только такие поиски учитываются в его статистике
+        bool
+        maybekey(const Key& x, bool *consulted = 0) const
+        {
+            if( !m_kfilter.load(boost::memory_order_relaxed) )
+                return true;
+            mapi_read_gate::reader reader(readgate());
+            if( !reader )
+                return true;
+            key_filter* kf = m_kfilter.load(boost::memory_order_acquire);
+            if( !kf )
+                return true;
+            if( !kf->may_contain(x) )
+                return false;
+            if( consulted )
+                *consulted = true;
+            return true;
+        }
+        //то же для значения
+        bool
+        maybevalue(const T& v, bool *consulted = 0) const
+        {
+            if( !m_vfilter.load(boost::memory_order_relaxed) )
+                return true;
+            mapi_read_gate::reader reader(readgate());
+            if( !reader )
+                return true;
+            value_filter* vf = m_vfilter.load(boost::memory_order_acquire);
+            if( !vf )
+                return true;
+            if( !vf->may_contain(v) )
+                return false;
+            if( consulted )
+                *consulted = true;
+            return true;
+        }
+        //вспомогательный метод очистки индексов
+        void
+        clearindex()
+        {
+            m_index.clear();
+            m_bitmaps.clear();
+            if( m_ring )
+                m_ring->clear();
+        }
+        //вспомогательный метод разбиения основного хранилища на не более чем threads непустых частей,
+        //bounds - границы частей
+        void
+        split(unsigned threads, std::vector<const_iterator>& bounds) const
+        {
+            size_type step = m_map.size() / (threads ? threads : 1) + 1;
+            const_iterator i = m_map.begin();
+            bounds.push_back(i);
+            while (i != m_map.end())
+            {
+                for (size_type n = 0; n < step && i != m_map.end(); ++n)
+                    ++i;
+                bounds.push_back(i);
+            }
+            if( bounds.size() == 1 )
+                bounds.push_back(i);
+        }
+        //вспомогательный метод проверки копии битового индекса: ключи keys[first, last) должны
+        //входить в битовые карты значений elements[first, last), в *result записывается 1, если
+        //часть корректна
+        static void
+        checkbitmaps(const mapi_key_space<Key>& space, const std::vector<Key>& keys,
+                const std::vector<element>& elements, const bitmaps& maps,
+                std::size_t first, std::size_t last, char *result)
+        {
+            for (std::size_t k = first; k < last; ++k)
+            {
+                typename mapi_key_space<Key>::ordinal_type o = 0;
+                typename bitmaps::const_iterator j = maps.find(
+                        elements[k].second);
+                if( !space.find(keys[k], o) || j == maps.end()
+                        || !j->second.contains(o) )
+                    return;
+            }
+            *result = 1;
+        }
+        //вспомогательный метод заполнения битового индекса по основному хранилищу
+        void
+        fillbitmaps()
+        {
+            if( m_space )
+                fillbitmaps(m_map, *m_space, m_bitmaps);
+        }
+        //вспомогательный метод заполнения битового индекса b по хранилищу m, пространство ключей
+        //блокируется отдельно, поэтому блокировка mapi не требуется
+        static void
+        fillbitmaps(const map& m, mapi_key_space<Key>& space, bitmaps& b)
+        {
+            for (typename map::const_iterator i = m.begin(); i != m.end(); ++i)
+                b[i->second.m_value].add(space.insert(i->first));
+        }
+        //вспомогательный метод заполнения пустых фильтров по основному хранилищу
+        void
+        fillfilters(key_filter *kf, value_filter *vf)
+        {
+            fillfilters(m_map, kf, vf);
+        }
+        //вспомогательный метод заполнения пустых фильтров по хранилищу m
+        static void
+        fillfilters(const map& m, key_filter *kf, value_filter *vf)
+        {
+            if( kf )
+                for (typename map::const_iterator i = m.begin(); i != m.end(); ++i)
+                    kf->insert(i->first);
+            if( vf )
+            {
+                // значения с несколькими ключами учитываются один раз
+                std::vector<T> values;
+                for (typename map::const_iterator i = m.begin(); i != m.end(); ++i)
+                    values.push_back(i->second.m_value);
+                std::sort(values.begin(), values.end());
+                values.erase(std::unique(values.begin(), values.end()),
+                        values.end());
+                for (typename std::vector<T>::const_iterator i = values.begin();
+                        i != values.end(); ++i)
+                    vf->insert(*i);
+            }
+        }
+        //вспомогательный метод замены содержимого основным хранилищем и индексом, построенными
+        //в loaded без блокировки. Битовый индекс, фильтры и кольцо CLOCK для них тоже строятся
+        //без блокировки по снимку настроек mapi; если настройки успели измениться (enable_bitmap,
+        //enable_filter, set_capacity), построение повторяется. Прежнее содержимое удаляется после
+        //снятия блокировки
+        void
+        replace(garbage& loaded)
+        {
+            std::unique_ptr<garbage> g(new garbage);
+            boost::shared_ptr<mapi_reclaimer> r;
+            for (;;)
+            {
+                boost::shared_ptr<mapi_key_space<Key> > space;
+                size_type kexpected = 0, kcounters = 0, vexpected = 0,
+                        vcounters = 0;
+                bool ring = false;
+                {
+                    boost::mutex::scoped_lock lock(m_mutex);
+                    space = m_space;
+                    key_filter *kf = m_kfilter.load(boost::memory_order_relaxed);
+                    value_filter *vf = m_vfilter.load(
+                            boost::memory_order_relaxed);
+                    if( kf )
+                    {
+                        kexpected = kf->expected();
+                        kcounters = kf->counters();
+                    }
+                    if( vf )
+                    {
+                        vexpected = vf->expected();
+                        vcounters = vf->counters();
+                    }
+                    ring = m_ring.get() != 0;
+                }
+                loaded.m_bitmaps.clear();
+                if( space )
+                    fillbitmaps(loaded.m_map, *space, loaded.m_bitmaps);
+                loaded.m_kfilter.reset(
+                        kexpected ? new key_filter(kexpected, kcounters) : 0);
+                loaded.m_vfilter.reset(
+                        vexpected ? new value_filter(vexpected, vcounters) : 0);
+                fillfilters(loaded.m_map, loaded.m_kfilter.get(),
+                        loaded.m_vfilter.get());
+                loaded.m_ring.reset(ring ? new clock_ring : 0);
+                if( ring )
+                    for (iterator i = loaded.m_map.begin();
+                            i != loaded.m_map.end(); ++i)
+                        loaded.m_ring->add(i);
+                boost::mutex::scoped_lock lock(m_mutex);
+                key_filter *kf = m_kfilter.load(boost::memory_order_relaxed);
+                value_filter *vf = m_vfilter.load(boost::memory_order_relaxed);
+                if( space != m_space || !kf != !loaded.m_kfilter
+                        || !vf != !loaded.m_vfilter || !m_ring != !ring )
+                    continue;
+                mapi_read_gate::writer gate(readgate());
+                r = m_reclaimer;
+                // кольцо уходит в g целиком, а не очищается под блокировкой в detach
+                g->m_ring.swap(m_ring);
+                detach(g.get());
+                m_map.swap(loaded.m_map);
+                m_index.swap(loaded.m_index);
+                m_bitmaps.swap(loaded.m_bitmaps);
+                m_ring.swap(loaded.m_ring);
+                if( kf )
+                    loaded.m_kfilter->inherit(*kf);
+                if( vf )
+                    loaded.m_vfilter->inherit(*vf);
+                m_kfilter.store(loaded.m_kfilter.release(),
+                        boost::memory_order_release);
+                m_vfilter.store(loaded.m_vfilter.release(),
+                        boost::memory_order_release);
+                g->m_kfilter.reset(kf);
+                g->m_vfilter.reset(vf);
+                record(mapi_change_reload, Key(), T(), T());
+                evict(m_map.end());
+                break;
+            }
+            dispose(g.release(), r);
+        }
+        //вспомогательный метод переноса всего содержимого в g, вызывается под блокировкой
+        void
+        detach(garbage *g)
+        {
+            m_map.swap(g->m_map);
+            m_index.swap(g->m_index);
+            m_bitmaps.swap(g->m_bitmaps);
+            clearindex();
+        }
+        //вспомогательный метод замены фильтров новыми, заполненными по текущему содержимому, старые
+        //переносятся в g. Вызывается под блокировкой и шлюзом писателя, поэтому ни один читатель
+        //не держит старый фильтр, а удалить его можно после снятия блокировки
+        void
+        renewfilters(garbage *g)
+        {
+            key_filter *kf = m_kfilter.load(boost::memory_order_relaxed);
+            value_filter *vf = m_vfilter.load(boost::memory_order_relaxed);
+            key_filter *nkf = kf ? kf->renew() : 0;
+            value_filter *nvf = vf ? vf->renew() : 0;
+            fillfilters(nkf, nvf);
+            m_kfilter.store(nkf, boost::memory_order_release);
+            m_vfilter.store(nvf, boost::memory_order_release);
+            g->m_kfilter.reset(kf);
+            g->m_vfilter.reset(vf);
+        }
+        //удаление отсоединенных данных, вызывается после снятия блокировки
+        static void
+        dispose(garbage *g, const boost::shared_ptr<mapi_reclaimer>& r)
+        {
+            if( r )
+                r->retire(g);
+            else
+                delete g;
+        }
+        //объединение битовых карт значений из диапазона [first, last)
+        template<typename InputIterator>
+            mapi_bitmap
+            unite(InputIterator first, InputIterator last) const
+            {
+                mapi_bitmap b;
+                for (; first != last; ++first)
+                {
+                    typename bitmaps::const_iterator i = m_bitmaps.find(*first);
+                    if( i != m_bitmaps.end() )
+                        b |= i->second;
+                }
+                return b;
+            }
+        //поиск по множеству значений, через битовый индекс или, если он не включен, через m_index
+        template<typename InputIterator, typename Map, typename MapIterator>
+            void
+            findany(InputIterator first, InputIterator last, Map& m,
+                    std::vector<MapIterator>& vec) const
+            {
+                if( m_space )
+                {
+                    std::vector<const Key*> keys;
+                    m_space->keys(unite(first, last), keys);
+                    vec.reserve(keys.size());
+                    for (typename std::vector<const Key*>::const_iterator i =
+                            keys.begin(); i != keys.end(); ++i)
+                        vec.push_back(m.find(**i));
+                    return;
+                }
+                std::vector<T> values(first, last);
+                std::sort(values.begin(), values.end());
+                values.erase(std::unique(values.begin(), values.end()),
+                        values.end());
+                for (typename std::vector<T>::const_iterator i = values.begin();
+                        i != values.end(); ++i)
+                    m_index.find(*i, m, vec);
+            }
     };
 
 template<typename CharT, typename Tratis, typename Keyf, typename Tf>
@@ -458,9 +2081,7 @@ template<typename CharT, typename Tratis, typename Keyf, typename Tf>
                 i != x.m_map.end(); ++i)
             os << i->first << '\t' << i->second << '\n';
         os << "\nIndex:\n";
-        for (typename mapi<Keyf, Tf>::index_const_iterator i =
-                x.m_index.begin(); i != x.m_index.end(); ++i)
-            os << i->first << '\t' << i->second << '\n';
+        x.m_index.print(os);
         return os;
     }
 
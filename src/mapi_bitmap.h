@@ -0,0 +1,455 @@
+/*
+ * mapi_bitmap.h
+ *
+ *  Created on: 19.10.2026
+ */
+
+#ifndef MAPI_BITMAP_H_
+#define MAPI_BITMAP_H_
+
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <cstddef>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/*
+ * Класс mapi_bitmap. Сжатое битовое множество 32-битных чисел в духе Roaring bitmap.
+ * Диапазон чисел разбит на блоки по 65536 значений, по старшим 16 битам. Каждый блок хранится
+ * либо отсортированным массивом младших 16 бит (до 4096 элементов), либо битовой картой из 1024
+ * 64-битных слов. Объединение и пересечение битовых карт выполняются пословно, такие циклы
+ * векторизуются компилятором.
+ *
+ * Не потокобезопасен, используется mapi под его блокировкой, или как значение-результат запроса.
+ */
+class mapi_bitmap
+{
+public:
+    //тип элемента
+    typedef boost::uint32_t value_type;
+    //тип размера
+    typedef std::size_t size_type;
+    //добавление элемента
+    void
+    add(value_type x)
+    {
+        chunk(high(x)).add(low(x));
+    }
+    //удаление элемента
+    void
+    remove(value_type x)
+    {
+        std::vector<boost::uint16_t>::iterator i = std::lower_bound(
+                m_keys.begin(), m_keys.end(), high(x));
+        if( i == m_keys.end() || *i != high(x) )
+            return;
+        std::size_t n = i - m_keys.begin();
+        m_chunks[n].remove(low(x));
+        if( m_chunks[n].card == 0 )
+        {
+            m_keys.erase(i);
+            m_chunks.erase(m_chunks.begin() + n);
+        }
+    }
+    //проверка принадлежности
+    bool
+    contains(value_type x) const
+    {
+        std::vector<boost::uint16_t>::const_iterator i = std::lower_bound(
+                m_keys.begin(), m_keys.end(), high(x));
+        if( i == m_keys.end() || *i != high(x) )
+            return false;
+        return m_chunks[i - m_keys.begin()].contains(low(x));
+    }
+    //мощность множества
+    size_type
+    cardinality() const
+    {
+        size_type n = 0;
+        for (std::vector<container>::const_iterator i = m_chunks.begin();
+                i != m_chunks.end(); ++i)
+            n += i->card;
+        return n;
+    }
+    bool
+    empty() const
+    {
+        return m_chunks.empty();
+    }
+    void
+    clear()
+    {
+        m_keys.clear();
+        m_chunks.clear();
+    }
+    //объединение
+    mapi_bitmap&
+    operator|=(const mapi_bitmap& x)
+    {
+        mapi_bitmap r;
+        std::size_t i = 0, j = 0;
+        while (i < m_keys.size() || j < x.m_keys.size())
+        {
+            if( j == x.m_keys.size()
+                    || (i < m_keys.size() && m_keys[i] < x.m_keys[j]) )
+            {
+                r.m_keys.push_back(m_keys[i]);
+                r.m_chunks.push_back(m_chunks[i++]);
+            }
+            else if( i == m_keys.size() || x.m_keys[j] < m_keys[i] )
+            {
+                r.m_keys.push_back(x.m_keys[j]);
+                r.m_chunks.push_back(x.m_chunks[j++]);
+            }
+            else
+            {
+                r.m_keys.push_back(m_keys[i]);
+                r.m_chunks.push_back(container());
+                r.m_chunks.back().unite(m_chunks[i++], x.m_chunks[j++]);
+            }
+        }
+        swap(r);
+        return *this;
+    }
+    //пересечение
+    mapi_bitmap&
+    operator&=(const mapi_bitmap& x)
+    {
+        mapi_bitmap r;
+        std::size_t i = 0, j = 0;
+        while (i < m_keys.size() && j < x.m_keys.size())
+        {
+            if( m_keys[i] < x.m_keys[j] )
+                ++i;
+            else if( x.m_keys[j] < m_keys[i] )
+                ++j;
+            else
+            {
+                container c;
+                c.intersect(m_chunks[i], x.m_chunks[j]);
+                if( c.card != 0 )
+                {
+                    r.m_keys.push_back(m_keys[i]);
+                    r.m_chunks.push_back(container());
+                    r.m_chunks.back().swap(c);
+                }
+                ++i;
+                ++j;
+            }
+        }
+        swap(r);
+        return *this;
+    }
+    //вывод всех элементов в порядке возрастания
+    template<typename OutputIterator>
+        OutputIterator
+        copy(OutputIterator out) const
+        {
+            for (std::size_t i = 0; i < m_keys.size(); ++i)
+                out = m_chunks[i].copy(value_type(m_keys[i]) << 16, out);
+            return out;
+        }
+    void
+    swap(mapi_bitmap& x)
+    {
+        m_keys.swap(x.m_keys);
+        m_chunks.swap(x.m_chunks);
+    }
+private:
+    //блок из 65536 значений
+    struct container
+    {
+        //предельный размер массива, при превышении блок переводится в битовую карту
+        static const std::size_t max_array = 4096;
+        //число слов битовой карты
+        static const std::size_t words = 1024;
+        container() :
+                card(0)
+        {
+        }
+        bool
+        bitset() const
+        {
+            return !bits.empty();
+        }
+        bool
+        contains(boost::uint16_t x) const
+        {
+            if( bitset() )
+                return (bits[x >> 6] >> (x & 63)) & 1;
+            return std::binary_search(array.begin(), array.end(), x);
+        }
+        void
+        add(boost::uint16_t x)
+        {
+            if( bitset() )
+            {
+                boost::uint64_t mask = boost::uint64_t(1) << (x & 63);
+                if( !(bits[x >> 6] & mask) )
+                {
+                    bits[x >> 6] |= mask;
+                    ++card;
+                }
+                return;
+            }
+            std::vector<boost::uint16_t>::iterator i = std::lower_bound(
+                    array.begin(), array.end(), x);
+            if( i != array.end() && *i == x )
+                return;
+            array.insert(i, x);
+            ++card;
+            if( card > max_array )
+                to_bitset();
+        }
+        void
+        remove(boost::uint16_t x)
+        {
+            if( bitset() )
+            {
+                boost::uint64_t mask = boost::uint64_t(1) << (x & 63);
+                if( bits[x >> 6] & mask )
+                {
+                    bits[x >> 6] &= ~mask;
+                    if( --card <= max_array )
+                        to_array();
+                }
+                return;
+            }
+            std::vector<boost::uint16_t>::iterator i = std::lower_bound(
+                    array.begin(), array.end(), x);
+            if( i != array.end() && *i == x )
+            {
+                array.erase(i);
+                --card;
+            }
+        }
+        //this = a | b
+        void
+        unite(const container& a, const container& b)
+        {
+            if( a.bitset() || b.bitset() )
+            {
+                const container& s = a.bitset() ? a : b;
+                const container& o = a.bitset() ? b : a;
+                bits = s.bits;
+                if( o.bitset() )
+                {
+                    for (std::size_t k = 0; k < words; ++k)
+                        bits[k] |= o.bits[k];
+                }
+                else
+                {
+                    for (std::size_t k = 0; k < o.array.size(); ++k)
+                        bits[o.array[k] >> 6] |= boost::uint64_t(1)
+                                << (o.array[k] & 63);
+                }
+                recount();
+                return;
+            }
+            array.reserve(a.array.size() + b.array.size());
+            std::set_union(a.array.begin(), a.array.end(), b.array.begin(),
+                    b.array.end(), std::back_inserter(array));
+            card = array.size();
+            if( card > max_array )
+                to_bitset();
+        }
+        //this = a & b
+        void
+        intersect(const container& a, const container& b)
+        {
+            if( a.bitset() && b.bitset() )
+            {
+                bits.resize(words);
+                for (std::size_t k = 0; k < words; ++k)
+                    bits[k] = a.bits[k] & b.bits[k];
+                recount();
+                if( card <= max_array )
+                    to_array();
+                return;
+            }
+            if( a.bitset() || b.bitset() )
+            {
+                const container& s = a.bitset() ? a : b;
+                const container& o = a.bitset() ? b : a;
+                for (std::size_t k = 0; k < o.array.size(); ++k)
+                    if( s.contains(o.array[k]) )
+                        array.push_back(o.array[k]);
+            }
+            else
+                std::set_intersection(a.array.begin(), a.array.end(),
+                        b.array.begin(), b.array.end(),
+                        std::back_inserter(array));
+            card = array.size();
+        }
+        template<typename OutputIterator>
+            OutputIterator
+            copy(value_type base, OutputIterator out) const
+            {
+                if( !bitset() )
+                {
+                    for (std::size_t k = 0; k < array.size(); ++k)
+                        *out++ = base | array[k];
+                    return out;
+                }
+                for (std::size_t k = 0; k < words; ++k)
+                {
+                    boost::uint64_t w = bits[k];
+                    while (w)
+                    {
+                        *out++ = base | value_type(k << 6 | __builtin_ctzll(w));
+                        w &= w - 1;
+                    }
+                }
+                return out;
+            }
+        void
+        recount()
+        {
+            card = 0;
+            for (std::size_t k = 0; k < words; ++k)
+                card += __builtin_popcountll(bits[k]);
+        }
+        void
+        to_bitset()
+        {
+            bits.assign(words, 0);
+            for (std::size_t k = 0; k < array.size(); ++k)
+                bits[array[k] >> 6] |= boost::uint64_t(1) << (array[k] & 63);
+            std::vector<boost::uint16_t>().swap(array);
+        }
+        void
+        to_array()
+        {
+            std::vector<boost::uint16_t> a;
+            a.reserve(card);
+            copy(0, std::back_inserter(a));
+            array.swap(a);
+            std::vector<boost::uint64_t>().swap(bits);
+        }
+        void
+        swap(container& x)
+        {
+            array.swap(x.array);
+            bits.swap(x.bits);
+            std::swap(card, x.card);
+        }
+        //отсортированный массив младших 16 бит
+        std::vector<boost::uint16_t> array;
+        //битовая карта, пустая если блок хранится массивом
+        std::vector<boost::uint64_t> bits;
+        //число элементов в блоке
+        std::size_t card;
+    };
+    static boost::uint16_t
+    high(value_type x)
+    {
+        return boost::uint16_t(x >> 16);
+    }
+    static boost::uint16_t
+    low(value_type x)
+    {
+        return boost::uint16_t(x & 0xffff);
+    }
+    //блок со старшими битами h, при отсутствии создается
+    container&
+    chunk(boost::uint16_t h)
+    {
+        std::vector<boost::uint16_t>::iterator i = std::lower_bound(
+                m_keys.begin(), m_keys.end(), h);
+        std::size_t n = i - m_keys.begin();
+        if( i == m_keys.end() || *i != h )
+        {
+            m_keys.insert(i, h);
+            m_chunks.insert(m_chunks.begin() + n, container());
+        }
+        return m_chunks[n];
+    }
+    //старшие 16 бит блоков, по возрастанию
+    std::vector<boost::uint16_t> m_keys;
+    //блоки, в том же порядке
+    std::vector<container> m_chunks;
+};
+
+inline mapi_bitmap
+operator|(mapi_bitmap a, const mapi_bitmap& b)
+{
+    return a |= b;
+}
+
+inline mapi_bitmap
+operator&(mapi_bitmap a, const mapi_bitmap& b)
+{
+    return a &= b;
+}
+
+/*
+ * Класс mapi_key_space. Пространство ключей, назначает каждому ключу плотный порядковый номер,
+ * который используется как элемент mapi_bitmap. Может разделяться несколькими mapi с общим множеством
+ * ключей, тогда битовые карты их значений можно пересекать и объединять между собой.
+ *
+ * Номера не освобождаются при удалении ключа из mapi, поскольку ключ может использоваться другими mapi.
+ * Потокобезопасен.
+ */
+template<typename Key>
+    class mapi_key_space : boost::noncopyable
+    {
+    public:
+        //тип порядкового номера
+        typedef mapi_bitmap::value_type ordinal_type;
+        //тип размера
+        typedef std::size_t size_type;
+        //номер ключа, при отсутствии ключ добавляется
+        ordinal_type
+        insert(const Key& k)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            std::pair<typename ordinals::iterator, bool> pair_ib =
+                    m_ordinals.insert(
+                            std::make_pair(k, ordinal_type(m_keys.size())));
+            if( pair_ib.second )
+                m_keys.push_back(&pair_ib.first->first);
+            return pair_ib.first->second;
+        }
+        //поиск номера ключа
+        bool
+        find(const Key& k, ordinal_type& o) const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            typename ordinals::const_iterator i = m_ordinals.find(k);
+            if( i == m_ordinals.end() )
+                return false;
+            o = i->second;
+            return true;
+        }
+        //ключи из битовой карты b, указатели действительны все время жизни пространства ключей
+        void
+        keys(const mapi_bitmap& b, std::vector<const Key*>& vec) const
+        {
+            std::vector<ordinal_type> ords;
+            ords.reserve(b.cardinality());
+            b.copy(std::back_inserter(ords));
+            boost::mutex::scoped_lock lock(m_mutex);
+            vec.reserve(vec.size() + ords.size());
+            for (typename std::vector<ordinal_type>::const_iterator i =
+                    ords.begin(); i != ords.end(); ++i)
+                vec.push_back(m_keys[*i]);
+        }
+        size_type
+        size() const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            return m_keys.size();
+        }
+    private:
+        typedef std::map<Key, ordinal_type> ordinals;
+        //ключ -> номер
+        ordinals m_ordinals;
+        //номер -> ключ
+        std::vector<const Key*> m_keys;
+        mutable boost::mutex m_mutex;
+    };
+
+#endif /* MAPI_BITMAP_H_ */
@@ -0,0 +1,186 @@
+/*
+ * mapi_feed.h
+ *
+ *  Created on: 19.10.2026
+ */
+
+#ifndef MAPI_FEED_H_
+#define MAPI_FEED_H_
+
+#include <vector>
+#include <cstddef>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+/*
+ * Вид изменения mapi.
+ */
+enum mapi_change_op
+{
+    //добавление ключа, old_value не используется
+    mapi_change_insert,
+    //удаление ключа, new_value не используется
+    mapi_change_erase,
+    //изменение значения существующего ключа
+    mapi_change_assign,
+    //удаление всех элементов, key и значения не используются
+    mapi_change_clear,
+    //замена всего содержимого (deserialize, operator=), key и значения не используются. Новое
+    //содержимое в журнал не пишется, read для более ранних номеров возвращает false
+    mapi_change_reload
+};
+
+/*
+ * Запись журнала изменений.
+ */
+template<typename Key, typename T>
+    struct mapi_change
+    {
+        mapi_change() :
+                seq(0), op(mapi_change_clear), key(), old_value(), new_value()
+        {
+        }
+        //порядковый номер записи, начиная с 0
+        boost::uint64_t seq;
+        mapi_change_op op;
+        Key key;
+        T old_value;
+        T new_value;
+    };
+
+/*
+ * Класс mapi_feed. Журнал изменений mapi (см. mapi::set_feed) - кольцевой буфер последних capacity записей.
+ * mapi добавляет записи под своей блокировкой, поэтому порядок записей совпадает с порядком изменений.
+ * Потребитель запоминает номер следующей нужной записи и читает записи пачками методом read. Если
+ * потребитель отстал больше, чем на capacity записей, read возвращает false, и реплику нужно
+ * построить заново (mapi::snapshot). Так же read сообщает о замене всего содержимого mapi
+ * (mapi_change_reload): вместо записи каждого нового элемента в журнал реплика строится заново.
+ * Пример:
+ * boost::shared_ptr<mapi_feed<string, int> > feed(new mapi_feed<string, int>(65536));
+ * a.set_feed(feed);
+ * std::map<string, int> replica;
+ * boost::uint64_t next = a.snapshot(replica);
+ * std::vector<mapi_change<string, int> > changes;
+ * if( feed->read(next, changes) )
+ *     next = mapi_apply(replica, changes.begin(), changes.end(), next);
+ */
+template<typename Key, typename T>
+    class mapi_feed : boost::noncopyable
+    {
+    public:
+        //тип записи
+        typedef mapi_change<Key, T> change;
+        //тип размера
+        typedef std::size_t size_type;
+        explicit
+        mapi_feed(size_type capacity) :
+                m_ring(capacity ? capacity : 1), m_next(0), m_reload(0)
+        {
+        }
+        //добавление записи, вызывается mapi под блокировкой. Записи буфера используются повторно,
+        //поэтому после заполнения буфера память для ключей и значений, как правило, не выделяется
+        void
+        push(mapi_change_op op, const Key& k, const T& old_value,
+                const T& new_value)
+        {
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                change& c = m_ring[m_next % m_ring.size()];
+                c.seq = m_next++;
+                c.op = op;
+                c.key = k;
+                c.old_value = old_value;
+                c.new_value = new_value;
+                if( op == mapi_change_reload )
+                    m_reload = m_next;
+            }
+            m_cond.notify_all();
+        }
+        //чтение не более max записей, начиная с номера from. false, если часть записей
+        //уже вытеснена из буфера или начиная с from содержимое mapi заменялось целиком
+        bool
+        read(boost::uint64_t from, std::vector<change>& out,
+                size_type max = size_type(-1)) const
+        {
+            out.clear();
+            boost::mutex::scoped_lock lock(m_mutex);
+            if( m_next > m_ring.size() && from < m_next - m_ring.size() )
+                return false;
+            if( from < m_reload )
+                return false;
+            for (; from < m_next && out.size() < max; ++from)
+                out.push_back(m_ring[from % m_ring.size()]);
+            return true;
+        }
+        //номер следующей записи
+        boost::uint64_t
+        next() const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            return m_next;
+        }
+        //ожидание записи с номером from не дольше timeout, true если запись появилась
+        bool
+        wait(boost::uint64_t from,
+                const boost::posix_time::time_duration& timeout) const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            boost::system_time deadline = boost::get_system_time() + timeout;
+            while (m_next <= from)
+                if( !m_cond.timed_wait(lock, deadline) )
+                    return m_next > from;
+            return true;
+        }
+        size_type
+        capacity() const
+        {
+            return m_ring.size();
+        }
+    private:
+        std::vector<change> m_ring;
+        boost::uint64_t m_next;
+        //номер записи, следующей за последней mapi_change_reload
+        boost::uint64_t m_reload;
+        mutable boost::mutex m_mutex;
+        mutable boost::condition_variable m_cond;
+    };
+
+/*
+ * Применение записей [first, last) к реплике m (std::map или mapi), записи с номерами меньше next
+ * пропускаются. Возвращает номер следующей нужной записи.
+ */
+template<typename Map, typename InputIterator>
+    boost::uint64_t
+    mapi_apply(Map& m, InputIterator first, InputIterator last,
+            boost::uint64_t next)
+    {
+        for (; first != last; ++first)
+        {
+            if( first->seq < next )
+                continue;
+            switch (first->op)
+            {
+            case mapi_change_insert:
+            case mapi_change_assign:
+                m[first->key] = first->new_value;
+                break;
+            case mapi_change_erase:
+                m.erase(first->key);
+                break;
+            case mapi_change_clear:
+                m.clear();
+                break;
+            case mapi_change_reload:
+                // read такие записи не выдает, реплика строится заново
+                break;
+            }
+            next = first->seq + 1;
+        }
+        return next;
+    }
+
+#endif /* MAPI_FEED_H_ */
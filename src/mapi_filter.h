@@ -0,0 +1,182 @@
+/*
+ * mapi_filter.h
+ *
+ *  Created on: 19.10.2026
+ */
+
+#ifndef MAPI_FILTER_H_
+#define MAPI_FILTER_H_
+
+#include <cstddef>
+#include <cmath>
+#include <boost/cstdint.hpp>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/functional/hash.hpp>
+
+/*
+ * Статистика фильтра mapi_filter.
+ */
+struct mapi_filter_stats
+{
+    mapi_filter_stats() :
+            lookups(0), false_positives(0), fpr(0)
+    {
+    }
+    //число поисков, на которые фильтр ответил "возможно есть" и которые дошли до дерева. Поиски,
+    //выполненные без фильтра (во время изменения mapi), не учитываются
+    std::size_t lookups;
+    //из них закончившихся неудачей
+    std::size_t false_positives;
+    //оценка вероятности ложного срабатывания по заполненности фильтра
+    double fpr;
+};
+
+/*
+ * Класс mapi_filter. Считающий фильтр Блума: вместо битов хранятся 8-битные счетчики, что позволяет
+ * удалять элементы. Счетчик, достигший 255, больше не меняется, это приводит только к ложным
+ * срабатываниям.
+ *
+ * Изменение (insert, erase, clear) выполняется под блокировкой mapi, то есть всегда одним потоком,
+ * поэтому счетчики меняются обычной записью без атомарных операций чтение-модификация-запись.
+ * Проверка may_contain блокировку не требует и может выполняться параллельно с изменением.
+ * Фильтр целиком не очищается на виду у читателей: при очистке mapi строит новый фильтр (renew)
+ * и только потом подменяет им старый. При перезагрузке (mapi::deserialize, mapi::operator=) новый
+ * фильтр с теми же параметрами (expected, counters) строится и заполняется без блокировки mapi,
+ * а под блокировкой к нему переходит статистика старого (inherit).
+ */
+template<typename K>
+    class mapi_filter : boost::noncopyable
+    {
+    public:
+        //тип размера
+        typedef std::size_t size_type;
+        //expected - ожидаемое число элементов, counters - число счетчиков на элемент
+        explicit
+        mapi_filter(size_type expected, size_type counters = 10) :
+                m_expected(expected), m_per(counters), m_size(expected * counters < 64 ? 64 : expected * counters),
+                // оптимальное число хеш-функций - counters * ln 2
+                m_hashes(counters < 2 ? 1 : size_type(counters * 0.693 + 0.5)),
+                m_counters(new boost::atomic<boost::uint8_t>[m_size])
+        {
+            clear();
+        }
+        void
+        insert(const K& k)
+        {
+            boost::uint64_t h1, h2;
+            hash(k, h1, h2);
+            for (size_type i = 0; i < m_hashes; ++i)
+            {
+                boost::atomic<boost::uint8_t>& c = m_counters[(h1 + i * h2)
+                        % m_size];
+                boost::uint8_t n = c.load(boost::memory_order_relaxed);
+                if( n != 255 )
+                    c.store(n + 1, boost::memory_order_release);
+            }
+        }
+        void
+        erase(const K& k)
+        {
+            boost::uint64_t h1, h2;
+            hash(k, h1, h2);
+            for (size_type i = 0; i < m_hashes; ++i)
+            {
+                boost::atomic<boost::uint8_t>& c = m_counters[(h1 + i * h2)
+                        % m_size];
+                boost::uint8_t n = c.load(boost::memory_order_relaxed);
+                if( n != 255 && n != 0 )
+                    c.store(n - 1, boost::memory_order_release);
+            }
+        }
+        //false означает, что элемента точно нет
+        bool
+        may_contain(const K& k) const
+        {
+            boost::uint64_t h1, h2;
+            hash(k, h1, h2);
+            for (size_type i = 0; i < m_hashes; ++i)
+                if( m_counters[(h1 + i * h2) % m_size].load(
+                        boost::memory_order_acquire) == 0 )
+                    return false;
+            return true;
+        }
+        void
+        clear()
+        {
+            for (size_type i = 0; i < m_size; ++i)
+                m_counters[i].store(0, boost::memory_order_release);
+        }
+        //новый пустой фильтр с теми же параметрами, статистика поисков переходит к нему
+        mapi_filter*
+        renew() const
+        {
+            mapi_filter *f = new mapi_filter(m_expected, m_per);
+            f->m_stats = m_stats;
+            return f;
+        }
+        //перенос статистики поисков из заменяемого фильтра x, вызывается под блокировкой mapi
+        void
+        inherit(const mapi_filter& x)
+        {
+            m_stats = x.m_stats;
+        }
+        //параметры конструктора
+        size_type
+        expected() const
+        {
+            return m_expected;
+        }
+        size_type
+        counters() const
+        {
+            return m_per;
+        }
+        //учет результата поиска, прошедшего фильтр, вызывается под блокировкой mapi
+        void
+        record(bool found)
+        {
+            ++m_stats.lookups;
+            if( !found )
+                ++m_stats.false_positives;
+        }
+        //статистика, вызывается под блокировкой mapi
+        mapi_filter_stats
+        stats() const
+        {
+            size_type used = 0;
+            for (size_type i = 0; i < m_size; ++i)
+                if( m_counters[i].load(boost::memory_order_relaxed) != 0 )
+                    ++used;
+            mapi_filter_stats s = m_stats;
+            s.fpr = std::pow(double(used) / m_size, double(m_hashes));
+            return s;
+        }
+    private:
+        //параметры конструктора
+        size_type m_expected;
+        size_type m_per;
+        //число счетчиков
+        size_type m_size;
+        //число хеш-функций
+        size_type m_hashes;
+        boost::scoped_array<boost::atomic<boost::uint8_t> > m_counters;
+        mapi_filter_stats m_stats;
+        //два независимых хеша для двойного хеширования
+        static void
+        hash(const K& k, boost::uint64_t& h1, boost::uint64_t& h2)
+        {
+            // boost::hash для целых чисел тождественен, поэтому результат перемешивается
+            boost::uint64_t h = boost::hash<K>()(k);
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ULL;
+            h ^= h >> 33;
+            h1 = h;
+            h2 = (h >> 32 | h << 32) | 1;
+        }
+    };
+
+#endif /* MAPI_FILTER_H_ */
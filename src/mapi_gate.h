@@ -0,0 +1,185 @@
+/*
+ * mapi_gate.h
+ *
+ *  Created on: 19.10.2026
+ */
+
+#ifndef MAPI_GATE_H_
+#define MAPI_GATE_H_
+
+#include <cstddef>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/thread.hpp>
+
+//число полос счетчиков, которые пишутся из многих потоков
+static const std::size_t mapi_stripes = 64;
+
+/*
+ * Полоса текущего потока, назначается по кругу при первом обращении.
+ */
+inline std::size_t
+mapi_stripe()
+{
+    static boost::atomic<std::size_t> next(0);
+    static thread_local std::size_t s = next.fetch_add(1,
+            boost::memory_order_relaxed) % mapi_stripes;
+    return s;
+}
+
+/*
+ * Класс mapi_read_gate. Пропускает читателей mapi::get без захвата общей блокировки.
+ *
+ * Читатель увеличивает счетчик своей полосы (полоса выбирается по потоку, у каждой своя строка кэша),
+ * затем проверяет флаг писателя. Писатель, уже захвативший блокировку mapi, поднимает флаг и ждет,
+ * пока счетчики всех полос обнулятся. Обе стороны используют последовательно согласованные операции,
+ * поэтому либо читатель увидит флаг и пойдет медленным путем через блокировку mapi, либо писатель
+ * дождется окончания чтения. Читатели разных потоков не пишут в общие строки кэша.
+ *
+ * Через шлюз также читаются фильтры Блума mapi, чтобы писатель мог подменить фильтр и удалить старый.
+ * Шлюз занимает stripes строк кэша, поэтому mapi создает его при первом вызове get или включении
+ * фильтров. Читатель и писатель принимают указатель на шлюз, при нулевом указателе читатель сразу
+ * получает отказ, а писатель не делает ничего, то есть mapi без get и фильтров не платит за шлюз
+ * ни временем, ни памятью.
+ */
+class mapi_read_gate : boost::noncopyable
+{
+public:
+    //число полос
+    static const std::size_t stripes = mapi_stripes;
+    mapi_read_gate() :
+            m_writing(false)
+    {
+        for (std::size_t s = 0; s < stripes; ++s)
+            m_stripes[s].readers.store(0, boost::memory_order_relaxed);
+    }
+    /*
+     * Вход читателя в шлюз g, проверить успех можно приведением к bool. При неуспехе идет запись
+     * или шлюз еще не создан, и читать нужно под блокировкой mapi.
+     */
+    class reader : boost::noncopyable
+    {
+    public:
+        explicit
+        reader(const mapi_read_gate *g) :
+                m_readers(g ? &g->m_stripes[mapi_stripe()].readers : 0), m_entered(
+                        false)
+        {
+            if( !m_readers )
+                return;
+            m_readers->fetch_add(1, boost::memory_order_seq_cst);
+            m_entered = !g->m_writing.load(boost::memory_order_seq_cst);
+            if( !m_entered )
+                m_readers->fetch_sub(1, boost::memory_order_release);
+        }
+        ~reader()
+        {
+            if( m_entered )
+                m_readers->fetch_sub(1, boost::memory_order_release);
+        }
+        operator bool() const
+        {
+            return m_entered;
+        }
+    private:
+        boost::atomic<unsigned> *m_readers;
+        bool m_entered;
+    };
+    /*
+     * Писатель шлюза g, создается под блокировкой mapi на время изменения основного хранилища.
+     * Шлюз создается тоже под блокировкой mapi, поэтому писатель, получивший нулевой указатель,
+     * не может пропустить читателя.
+     */
+    class writer : boost::noncopyable
+    {
+    public:
+        explicit
+        writer(mapi_read_gate *g) :
+                m_gate(g)
+        {
+            if( !m_gate )
+                return;
+            m_gate->m_writing.store(true, boost::memory_order_seq_cst);
+            for (std::size_t s = 0; s < stripes; ++s)
+                while (m_gate->m_stripes[s].readers.load(
+                        boost::memory_order_seq_cst))
+                    boost::this_thread::yield();
+        }
+        ~writer()
+        {
+            if( m_gate )
+                m_gate->m_writing.store(false, boost::memory_order_release);
+        }
+    private:
+        mapi_read_gate *m_gate;
+    };
+private:
+    //счетчик читателей полосы, занимает строку кэша целиком
+    struct alignas(64) stripe_counter
+    {
+        mutable boost::atomic<unsigned> readers;
+    };
+    boost::atomic<bool> m_writing;
+    stripe_counter m_stripes[stripes];
+};
+
+/*
+ * Класс mapi_hit_counter. Счетчики удачных и неудачных поисков, которые ведут читатели разных потоков.
+ * Поток пишет только в свою полосу (см. mapi_stripe), полосы занимают отдельные строки кэша, итог
+ * суммируется при чтении и может не учитывать увеличения, сделанные одновременно с ним.
+ */
+class mapi_hit_counter : boost::noncopyable
+{
+public:
+    mapi_hit_counter()
+    {
+        reset();
+    }
+    void
+    hit()
+    {
+        m_stripes[mapi_stripe()].hits.fetch_add(1,
+                boost::memory_order_relaxed);
+    }
+    void
+    miss()
+    {
+        m_stripes[mapi_stripe()].misses.fetch_add(1,
+                boost::memory_order_relaxed);
+    }
+    std::size_t
+    hits() const
+    {
+        std::size_t n = 0;
+        for (std::size_t s = 0; s < mapi_stripes; ++s)
+            n += m_stripes[s].hits.load(boost::memory_order_relaxed);
+        return n;
+    }
+    std::size_t
+    misses() const
+    {
+        std::size_t n = 0;
+        for (std::size_t s = 0; s < mapi_stripes; ++s)
+            n += m_stripes[s].misses.load(boost::memory_order_relaxed);
+        return n;
+    }
+    void
+    reset()
+    {
+        for (std::size_t s = 0; s < mapi_stripes; ++s)
+        {
+            m_stripes[s].hits.store(0, boost::memory_order_relaxed);
+            m_stripes[s].misses.store(0, boost::memory_order_relaxed);
+        }
+    }
+private:
+    //счетчики полосы, занимают строку кэша целиком
+    struct alignas(64) stripe_counter
+    {
+        boost::atomic<std::size_t> hits;
+        boost::atomic<std::size_t> misses;
+    };
+    stripe_counter m_stripes[mapi_stripes];
+};
+
+#endif /* MAPI_GATE_H_ */
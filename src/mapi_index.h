@@ -0,0 +1,677 @@
+/*
+ * mapi_index.h
+ *
+ *  Created on: 19.10.2026
+ */
+
+#ifndef MAPI_INDEX_H_
+#define MAPI_INDEX_H_
+
+#include <map>
+#include <set>
+#include <iterator>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cassert>
+#include <stdexcept>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/is_integral.hpp>
+#include <boost/type_traits/is_enum.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/bind/bind.hpp>
+
+/*
+ * Свойство mapi_dense_value. Для целочисленных типов и перечислений с небольшим диапазоном значений
+ * позволяет заменить индекс std::multimap массивом корзин, по одной на каждое значение.
+ * По умолчанию выключено, включается специализацией для конкретного типа T:
+ *
+ * enum color { red, green, blue };
+ * template<>
+ *     struct mapi_dense_value<color>
+ *     {
+ *         static const bool dense = true;
+ *         // значения должны лежать в диапазоне [0, bound)
+ *         static const std::size_t bound = 3;
+ *     };
+ *
+ * При попытке записать в mapi значение вне диапазона возбуждается исключение std::out_of_range.
+ */
+template<typename T>
+    struct mapi_dense_value
+    {
+        static const bool dense = false;
+        static const std::size_t bound = 0;
+    };
+
+/*
+ * Число шагов вперед от предыдущего найденного элемента, после которого поиск по отсортированному
+ * набору проб переходит на спуск от корня дерева.
+ */
+const int mapi_finger_steps = 8;
+
+/*
+ * Поиск нижней границы k в упорядоченном ассоциативном контейнере c, начиная с итератора finger.
+ * finger должен быть не дальше нижней границы k, так бывает при обходе отсортированного набора проб.
+ * Близкие пробы находятся за несколько шагов, дальние - обычным спуском от корня.
+ */
+template<typename Container, typename Iterator, typename K>
+    Iterator
+    mapi_finger_lower_bound(Container& c, Iterator finger, const K& k)
+    {
+        for (int n = 0; n < mapi_finger_steps; ++n)
+        {
+            if( finger == c.end() || !(finger->first < k) )
+                return finger;
+            ++finger;
+        }
+        return c.lower_bound(k);
+    }
+
+/*
+ * Сравнение номеров элементов вектора по самим элементам
+ */
+template<typename T>
+    class mapi_order_less
+    {
+    public:
+        explicit
+        mapi_order_less(const std::vector<T>& v) :
+                m_v(v)
+        {
+        }
+        bool
+        operator()(std::size_t a, std::size_t b) const
+        {
+            return m_v[a] < m_v[b];
+        }
+    private:
+        const std::vector<T>& m_v;
+    };
+
+/*
+ * Номера элементов v в порядке возрастания элементов
+ */
+template<typename T>
+    void
+    mapi_sort_order(const std::vector<T>& v, std::vector<std::size_t>& order)
+    {
+        order.resize(v.size());
+        for (std::size_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+        mapi_order_less<T> less(v);
+        for (std::size_t i = 1; i < order.size(); ++i)
+            if( less(order[i], order[i - 1]) )
+            {
+                std::stable_sort(order.begin(), order.end(), less);
+                break;
+            }
+    }
+
+/*
+ * Устойчивая сортировка и слияние частей вектора, выполняются в потоках mapi_parallel_sort
+ */
+template<typename RandomIterator, typename Less>
+    void
+    mapi_sort_range(RandomIterator first, RandomIterator last, Less less)
+    {
+        std::stable_sort(first, last, less);
+    }
+
+template<typename RandomIterator, typename Less>
+    void
+    mapi_merge_range(RandomIterator first, RandomIterator middle,
+            RandomIterator last, Less less)
+    {
+        std::inplace_merge(first, middle, last, less);
+    }
+
+/*
+ * Устойчивая сортировка v в threads потоках: части сортируются параллельно, затем соседние части
+ * попарно сливаются, тоже параллельно. Для маленьких v сортировка выполняется в вызывающем потоке.
+ */
+template<typename T, typename Less>
+    void
+    mapi_parallel_sort(std::vector<T>& v, Less less, unsigned threads)
+    {
+        typedef typename std::vector<T>::iterator iterator;
+        if( threads < 2 || v.size() < threads * 4096 )
+        {
+            std::stable_sort(v.begin(), v.end(), less);
+            return;
+        }
+        std::vector<iterator> bounds;
+        for (std::size_t t = 0; t <= threads; ++t)
+            bounds.push_back(v.begin() + v.size() * t / threads);
+        boost::thread_group sorters;
+        for (std::size_t t = 0; t < threads; ++t)
+            sorters.create_thread(
+                    boost::bind(&mapi_sort_range<iterator, Less>, bounds[t],
+                            bounds[t + 1], less));
+        sorters.join_all();
+        for (std::size_t step = 1; step < threads; step *= 2)
+        {
+            boost::thread_group mergers;
+            for (std::size_t t = 0; t + step < threads; t += 2 * step)
+                mergers.create_thread(
+                        boost::bind(&mapi_merge_range<iterator, Less>,
+                                bounds[t], bounds[t + step],
+                                bounds[std::min<std::size_t>(t + 2 * step,
+                                        threads)], less));
+            mergers.join_all();
+        }
+    }
+
+/*
+ * Служебная часть reference_mapped_type, которая нужна индексу. Для индекса на основе std::multimap
+ * она пустая, для плотного индекса хранит позицию элемента в корзине, что позволяет удалять
+ * из индекса за O(1).
+ */
+template<typename T, bool Dense = mapi_dense_value<T>::dense>
+    class mapi_index_hook
+    {
+    };
+
+template<typename T>
+    class mapi_index_hook<T, true>
+    {
+        template<typename Key, typename Tm, typename Iterator, bool Dense>
+            friend class mapi_index;
+    protected:
+        mapi_index_hook() :
+                m_slot(0)
+        {
+        }
+    private:
+        //позиция в корзине плотного индекса
+        std::size_t m_slot;
+    };
+
+/*
+ * Индекс mapi по значению. Iterator - итератор основного хранилища mapi.
+ * Общий вариант хранит пары (значение, указатель на ключ) в std::set, упорядоченные по значению,
+ * а при равных значениях по ключу. Ключ хранится только в узле основного хранилища, адрес которого
+ * не меняется, в том числе при переносе узла в другой mapi. Поэтому поиск и удаление конкретной пары выполняются за O(log n) независимо
+ * от числа ключей с тем же значением, а поиск по значению - по сравнению только значений.
+ */
+template<typename Key, typename T, typename Iterator,
+        bool Dense = mapi_dense_value<T>::dense>
+    class mapi_index
+    {
+    public:
+        //тип элемента индекса
+        typedef std::pair<T, const Key*> entry;
+        //сравнение элементов индекса между собой и со значениями
+        struct entry_less
+        {
+            typedef void is_transparent;
+            bool
+            operator()(const entry& a, const entry& b) const
+            {
+                return a.first < b.first
+                        || (!(b.first < a.first) && *a.second < *b.second);
+            }
+            bool
+            operator()(const entry& a, const T& b) const
+            {
+                return a.first < b;
+            }
+            bool
+            operator()(const T& a, const entry& b) const
+            {
+                return a < b.first;
+            }
+        };
+        //тип контейнера индекса
+        typedef std::set<entry, entry_less> container;
+        //тип индексного итератора
+        typedef typename container::iterator iterator;
+        //тип констатного индексного итератора
+        typedef typename container::const_iterator const_iterator;
+        //тип пара индексных итераторов
+        typedef std::pair<iterator, iterator> pair_iterator;
+        //тип пара констатных индексных итераторов
+        typedef std::pair<const_iterator, const_iterator> pair_const_iterator;
+        //тип размера
+        typedef typename container::size_type size_type;
+        //тип извлеченного узла индекса
+        typedef typename container::node_type node_type;
+        //проверка допустимости значения, для общего варианта допустимо любое
+        void
+        check(const T&) const
+        {
+        }
+        //добавление элемента основного хранилища со значением v
+        void
+        insert(const T& v, Iterator i)
+        {
+            m_index.insert(entry(v, &i->first));
+        }
+        //то же, с использованием узла n, извлеченного из индекса с тем же элементом, пустой
+        //узел создается заново
+        void
+        insert(node_type& n, const T& v, Iterator i)
+        {
+            if( n.empty() )
+                insert(v, i);
+            else
+                m_index.insert(std::move(n));
+        }
+        //построение пустого индекса по всем элементам основного хранилища [first, last),
+        //сортировка выполняется в threads потоках
+        void
+        build(Iterator first, Iterator last, unsigned threads = 1)
+        {
+            std::vector<std::pair<T, Iterator> > entries;
+            for (; first != last; ++first)
+                entries.push_back(std::make_pair(T(first->second), first));
+            // при равных значениях сохраняется порядок ключей, то есть порядок индекса
+            mapi_parallel_sort(entries, value_less(), threads);
+            for (typename std::vector<std::pair<T, Iterator> >::const_iterator i =
+                    entries.begin(); i != entries.end(); ++i)
+                m_index.insert(m_index.end(),
+                        entry(i->first, &i->second->first));
+        }
+        //удаление элемента основного хранилища со значением v
+        void
+        erase(const T& v, Iterator i)
+        {
+            m_index.erase(position(v, i));
+        }
+        //то же, узел индекса не освобождается, а возвращается вызывающему
+        node_type
+        extract(const T& v, Iterator i)
+        {
+            return m_index.extract(position(v, i));
+        }
+        //обмен содержимым
+        void
+        swap(mapi_index& x)
+        {
+            m_index.swap(x.m_index);
+        }
+        //поиск по значению, итераторы основного хранилища m добавляются в vec
+        template<typename Map, typename MapIterator>
+            void
+            find(const T& v, Map& m, std::vector<MapIterator>& vec) const
+            {
+                pair_const_iterator pairi = m_index.equal_range(v);
+                for (; pairi.first != pairi.second; ++pairi.first)
+                    vec.push_back(m.find(*pairi.first->second));
+            }
+        //поиск по набору значений values, order - номера значений в порядке возрастания,
+        //результат для values[i] добавляется в vecs[i]
+        template<typename Map, typename MapIterator>
+            void
+            find_many(const std::vector<T>& values,
+                    const std::vector<std::size_t>& order, Map& m,
+                    std::vector<std::vector<MapIterator> >& vecs) const
+            {
+                // сначала собираются ключи, затем они ищутся в m в порядке возрастания
+                std::vector<probe> probes;
+                const_iterator finger = m_index.begin(), first = finger;
+                for (std::size_t k = 0; k < order.size(); ++k)
+                {
+                    const T& v = values[order[k]];
+                    // повторное значение ищется с начала предыдущего диапазона
+                    if( k > 0 && !(values[order[k - 1]] < v) )
+                        finger = first;
+                    first = finger = mapi_finger_lower_bound(m_index, finger, v);
+                    std::vector<MapIterator>& vec = vecs[order[k]];
+                    for (; finger != m_index.end() && !(v < finger->first);
+                            ++finger)
+                    {
+                        probes.push_back(
+                                probe(finger->second,
+                                        std::make_pair(order[k], vec.size())));
+                        vec.push_back(m.end());
+                    }
+                }
+                std::sort(probes.begin(), probes.end(), probe_less());
+                MapIterator mfinger = m.begin();
+                for (typename std::vector<probe>::const_iterator i =
+                        probes.begin(); i != probes.end(); ++i)
+                {
+                    mfinger = mapi_finger_lower_bound(m, mfinger, *i->first);
+                    vecs[i->second.first][i->second.second] = mfinger;
+                }
+            }
+        //не более n элементов, следующих в порядке (значение, ключ) за парой (*v, *k), при нулевом v -
+        //с начала индекса. Итераторы основного хранилища m добавляются в vec
+        template<typename Map, typename MapIterator>
+            void
+            next(const T* v, const Key* k, size_type n, Map& m,
+                    std::vector<MapIterator>& vec) const
+            {
+                const_iterator i =
+                        v ? m_index.upper_bound(entry(*v, k)) : m_index.begin();
+                for (; i != m_index.end() && n; ++i, --n)
+                    vec.push_back(m.find(*i->second));
+            }
+        //не более n последних в порядке (значение, ключ) элементов, в обратном порядке
+        template<typename Map, typename MapIterator>
+            void
+            last(size_type n, Map& m, std::vector<MapIterator>& vec) const
+            {
+                for (typename container::const_reverse_iterator i =
+                        m_index.rbegin(); i != m_index.rend() && n; ++i, --n)
+                    vec.push_back(m.find(*i->second));
+            }
+        //количество элементов со значением v
+        size_type
+        count(const T& v) const
+        {
+            pair_const_iterator pairi = m_index.equal_range(v);
+            return std::distance(pairi.first, pairi.second);
+        }
+        //есть ли элементы со значением v
+        bool
+        contains(const T& v) const
+        {
+            return m_index.find(v) != m_index.end();
+        }
+        //количество вхождений в индекс элемента основного хранилища со значением v
+        template<typename MapIterator>
+            size_type
+            count(const T& v, MapIterator i) const
+            {
+                return m_index.count(entry(v, &i->first));
+            }
+        //копия содержимого для проверки вне блокировки: пары (адрес ключа в узле основного
+        //хранилища, значение)
+        void
+        copy(std::vector<std::pair<const Key*, T> >& vec) const
+        {
+            vec.reserve(vec.size() + m_index.size());
+            for (const_iterator i = m_index.begin(); i != m_index.end(); ++i)
+                vec.push_back(std::make_pair(i->second, i->first));
+        }
+        size_type
+        size() const
+        {
+            return m_index.size();
+        }
+        void
+        clear()
+        {
+            m_index.clear();
+        }
+        //вывод пар (значение, ключ)
+        template<typename Ostream>
+            void
+            print(Ostream& os) const
+            {
+                for (const_iterator i = m_index.begin(); i != m_index.end();
+                        ++i)
+                    os << i->first << '\t' << *i->second << '\n';
+            }
+    private:
+        //ключ из индекса и место для результата: (номер значения, позиция в результате)
+        typedef std::pair<const Key*, std::pair<std::size_t, std::size_t> > probe;
+        struct value_less
+        {
+            bool
+            operator()(const std::pair<T, Iterator>& a,
+                    const std::pair<T, Iterator>& b) const
+            {
+                return a.first < b.first;
+            }
+        };
+        struct probe_less
+        {
+            bool
+            operator()(const probe& a, const probe& b) const
+            {
+                return *a.first < *b.first;
+            }
+        };
+        container m_index;
+        //позиция элемента основного хранилища со значением v
+        iterator
+        position(const T& v, Iterator i)
+        {
+            iterator j = m_index.find(entry(v, &i->first));
+            assert(j != m_index.end());
+            // срабатывание, означает ошибку в программе
+            return j;
+        }
+    };
+
+/*
+ * Плотный индекс для целочисленных значений и перечислений из диапазона [0, mapi_dense_value<T>::bound).
+ * Хранит массив корзин, корзина - вектор итераторов основного хранилища. Поиск, подсчет и удаление
+ * выполняются за O(1) плюс размер результата, ключи в индексе не дублируются. Корзины не упорядочены
+ * по ключам: страница обхода в порядке (значение, ключ) просматривает корзину, но сортирует только
+ * отобранные для страницы элементы.
+ */
+template<typename Key, typename T, typename Iterator>
+    class mapi_index<Key, T, Iterator, true>
+    {
+        BOOST_STATIC_ASSERT(
+                (boost::is_integral<T>::value || boost::is_enum<T>::value));
+        BOOST_STATIC_ASSERT(mapi_dense_value<T>::bound > 0);
+    public:
+        //тип корзины
+        typedef std::vector<Iterator> bucket;
+        //тип размера
+        typedef typename bucket::size_type size_type;
+        //извлеченный узел, корзины узлов не имеют
+        struct node_type
+        {
+        };
+        mapi_index() :
+                m_buckets(mapi_dense_value<T>::bound), m_size(0)
+        {
+        }
+        //проверка допустимости значения
+        void
+        check(const T& v) const
+        {
+            if( !valid(v) )
+                throw std::out_of_range("mapi: value out of dense range");
+        }
+        //заполнение корзин линейно, сортировка не нужна, поэтому threads не используется
+        void
+        build(Iterator first, Iterator last, unsigned = 1)
+        {
+            for (; first != last; ++first)
+                insert(T(first->second), first);
+        }
+        void
+        insert(const T& v, Iterator i)
+        {
+            bucket& b = m_buckets[slot(v)];
+            i->second.m_slot = b.size();
+            b.push_back(i);
+            ++m_size;
+        }
+        void
+        insert(node_type&, const T& v, Iterator i)
+        {
+            insert(v, i);
+        }
+        void
+        erase(const T& v, Iterator i)
+        {
+            bucket& b = m_buckets[slot(v)];
+            std::size_t pos = i->second.m_slot;
+            assert(pos < b.size() && b[pos] == i);
+            // срабатывание, означает ошибку в программе
+            b[pos] = b.back();
+            b[pos]->second.m_slot = pos;
+            b.pop_back();
+            --m_size;
+        }
+        node_type
+        extract(const T& v, Iterator i)
+        {
+            erase(v, i);
+            return node_type();
+        }
+        void
+        swap(mapi_index& x)
+        {
+            m_buckets.swap(x.m_buckets);
+            std::swap(m_size, x.m_size);
+        }
+        template<typename Map, typename MapIterator>
+            void
+            find(const T& v, Map&, std::vector<MapIterator>& vec) const
+            {
+                if( !valid(v) )
+                    return;
+                const bucket& b = m_buckets[slot(v)];
+                vec.insert(vec.end(), b.begin(), b.end());
+            }
+        template<typename Map, typename MapIterator>
+            void
+            find_many(const std::vector<T>& values,
+                    const std::vector<std::size_t>&, Map& m,
+                    std::vector<std::vector<MapIterator> >& vecs) const
+            {
+                for (std::size_t k = 0; k < values.size(); ++k)
+                    find(values[k], m, vecs[k]);
+            }
+        //корзины не упорядочены по ключам, поэтому из каждой просматриваемой корзины отбираются
+        //не более n элементов с наименьшими ключами, это O(размер корзины * log n) на страницу
+        //и O(n) дополнительной памяти
+        template<typename Map, typename MapIterator>
+            void
+            next(const T* v, const Key* k, size_type n, Map&,
+                    std::vector<MapIterator>& vec) const
+            {
+                std::vector<Iterator> heap;
+                for (std::size_t s = v ? slot(*v) : 0;
+                        s < m_buckets.size() && n; ++s)
+                    take(m_buckets[s], v && s == slot(*v) ? k : 0, n,
+                            key_less(), heap, vec);
+            }
+        template<typename Map, typename MapIterator>
+            void
+            last(size_type n, Map&, std::vector<MapIterator>& vec) const
+            {
+                std::vector<Iterator> heap;
+                for (std::size_t s = m_buckets.size(); s > 0 && n; --s)
+                    take(m_buckets[s - 1], 0, n, key_greater(), heap, vec);
+            }
+        size_type
+        count(const T& v) const
+        {
+            return valid(v) ? m_buckets[slot(v)].size() : 0;
+        }
+        bool
+        contains(const T& v) const
+        {
+            return valid(v) && !m_buckets[slot(v)].empty();
+        }
+        template<typename MapIterator>
+            size_type
+            count(const T& v, MapIterator i) const
+            {
+                if( !valid(v) )
+                    return 0;
+                const bucket& b = m_buckets[slot(v)];
+                std::size_t pos = i->second.m_slot;
+                return pos < b.size() && MapIterator(b[pos]) == i ? 1 : 0;
+            }
+        //копия содержимого для проверки вне блокировки, элемент с неверной позицией в корзине
+        //копируется с нулевым адресом ключа
+        void
+        copy(std::vector<std::pair<const Key*, T> >& vec) const
+        {
+            vec.reserve(vec.size() + m_size);
+            for (std::size_t v = 0; v < m_buckets.size(); ++v)
+                for (std::size_t pos = 0; pos < m_buckets[v].size(); ++pos)
+                {
+                    Iterator i = m_buckets[v][pos];
+                    vec.push_back(
+                            std::make_pair(
+                                    i->second.m_slot == pos ? &i->first : 0,
+                                    static_cast<T>(v)));
+                }
+        }
+        size_type
+        size() const
+        {
+            return m_size;
+        }
+        void
+        clear()
+        {
+            for (typename std::vector<bucket>::iterator i = m_buckets.begin();
+                    i != m_buckets.end(); ++i)
+                bucket().swap(*i);
+            m_size = 0;
+        }
+        template<typename Ostream>
+            void
+            print(Ostream& os) const
+            {
+                for (std::size_t v = 0; v < m_buckets.size(); ++v)
+                    for (typename bucket::const_iterator i =
+                            m_buckets[v].begin(); i != m_buckets[v].end(); ++i)
+                        os << static_cast<T>(v) << '\t' << (*i)->first << '\n';
+            }
+    private:
+        struct key_less
+        {
+            bool
+            operator()(Iterator a, Iterator b) const
+            {
+                return a->first < b->first;
+            }
+        };
+        struct key_greater
+        {
+            bool
+            operator()(Iterator a, Iterator b) const
+            {
+                return b->first < a->first;
+            }
+        };
+        std::vector<bucket> m_buckets;
+        size_type m_size;
+        //перенос в vec не более n первых в порядке less элементов корзины b с ключами больше *after
+        //(при нулевом after - всех), n уменьшается. Отобранные элементы держатся в куче heap размером
+        //не больше n, с худшим на вершине, поэтому корзина не копируется и не сортируется целиком
+        template<typename Less, typename MapIterator>
+            static void
+            take(const bucket& b, const Key* after, size_type& n, Less less,
+                    std::vector<Iterator>& heap, std::vector<MapIterator>& vec)
+            {
+                heap.clear();
+                for (typename bucket::const_iterator i = b.begin(); i != b.end();
+                        ++i)
+                {
+                    if( after && !(*after < (*i)->first) )
+                        continue;
+                    if( heap.size() < n )
+                    {
+                        heap.push_back(*i);
+                        std::push_heap(heap.begin(), heap.end(), less);
+                    }
+                    else if( less(*i, heap.front()) )
+                    {
+                        std::pop_heap(heap.begin(), heap.end(), less);
+                        heap.back() = *i;
+                        std::push_heap(heap.begin(), heap.end(), less);
+                    }
+                }
+                std::sort_heap(heap.begin(), heap.end(), less);
+                vec.insert(vec.end(), heap.begin(), heap.end());
+                n -= heap.size();
+            }
+        static bool
+        valid(const T& v)
+        {
+            return static_cast<std::size_t>(v) < mapi_dense_value<T>::bound;
+        }
+        static std::size_t
+        slot(const T& v)
+        {
+            return static_cast<std::size_t>(v);
+        }
+    };
+
+#endif /* MAPI_INDEX_H_ */
@@ -0,0 +1,106 @@
+/*
+ * mapi_reclaim.h
+ *
+ *  Created on: 19.10.2026
+ */
+
+#ifndef MAPI_RECLAIM_H_
+#define MAPI_RECLAIM_H_
+
+#include <deque>
+#include <cstddef>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/*
+ * Базовый класс отложенно удаляемых данных. Удаление выполняет деструктор наследника.
+ */
+class mapi_garbage
+{
+public:
+    virtual
+    ~mapi_garbage()
+    {
+    }
+};
+
+/*
+ * Класс mapi_reclaimer. Фоновый поток, удаляющий структуры, отсоединенные от mapi при очистке
+ * и удалении диапазона. Может разделяться несколькими mapi (см. mapi::set_reclaimer).
+ * При уничтожении дожидается удаления всех переданных ему данных.
+ */
+class mapi_reclaimer : boost::noncopyable
+{
+public:
+    mapi_reclaimer() :
+            m_stop(false), m_busy(false)
+    {
+        m_thread = boost::thread(&mapi_reclaimer::run, this);
+    }
+    ~mapi_reclaimer()
+    {
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_all();
+        m_thread.join();
+    }
+    //передача данных на удаление, владение переходит к mapi_reclaimer
+    void
+    retire(mapi_garbage *g)
+    {
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_queue.push_back(g);
+        }
+        m_cond.notify_all();
+    }
+    //ожидание удаления всех переданных данных
+    void
+    wait()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        while (!m_queue.empty() || m_busy)
+            m_cond.wait(lock);
+    }
+    //число данных в очереди на удаление
+    std::size_t
+    pending() const
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        return m_queue.size();
+    }
+private:
+    std::deque<mapi_garbage*> m_queue;
+    bool m_stop;
+    //поток удаляет данные
+    bool m_busy;
+    mutable boost::mutex m_mutex;
+    boost::condition_variable m_cond;
+    boost::thread m_thread;
+    void
+    run()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        for (;;)
+        {
+            while (m_queue.empty() && !m_stop)
+                m_cond.wait(lock);
+            if( m_queue.empty() )
+                return;
+            mapi_garbage *g = m_queue.front();
+            m_queue.pop_front();
+            m_busy = true;
+            lock.unlock();
+            delete g;
+            lock.lock();
+            m_busy = false;
+            m_cond.notify_all();
+        }
+    }
+};
+
+#endif /* MAPI_RECLAIM_H_ */
@@ -0,0 +1,111 @@
+/*
+ * mapi_reload.h
+ *
+ *  Created on: 19.10.2026
+ */
+
+#ifndef MAPI_RELOAD_H_
+#define MAPI_RELOAD_H_
+
+#include <map>
+#include <list>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include "mapi.h"
+
+/*
+ * Класс mapi_publisher. Публикация версий mapi для полной перезагрузки данных без остановки читателей.
+ * Новая версия строится в стороне конструктором mapi, который заполняет индекс целиком, и затем
+ * атомарно подменяет текущую. Читатель получает текущую версию методом current() и работает с ней
+ * сколько угодно долго. Замененные версии сохраняются у публикатора и удаляются при следующих публикациях
+ * или вызове reclaim(), когда их освободит последний читатель, поэтому удаление больших структур
+ * выполняется в потоке загрузки, а не в потоке читателя.
+ * Пример:
+ * mapi_publisher<string, int> p;
+ * p.reload(new_data);                       // в потоке загрузки
+ * mapi_publisher<string, int>::pointer m = p.current();   // в потоке читателя
+ * m->find("test1");
+ *
+ * Версии константные, для изменения данных используется reload или publish новой версии.
+ */
+template<typename Key, typename T>
+    class mapi_publisher : boost::noncopyable
+    {
+    public:
+        //тип версии
+        typedef mapi<Key, T> mapi_type;
+        //тип указателя на версию
+        typedef boost::shared_ptr<const mapi_type> pointer;
+        mapi_publisher() :
+                m_current(new mapi_type)
+        {
+        }
+        explicit
+        mapi_publisher(const std::map<Key, T>& x) :
+                m_current(new mapi_type(x))
+        {
+        }
+        //текущая версия
+        pointer
+        current() const
+        {
+            return boost::atomic_load(&m_current);
+        }
+        //публикация готовой версии
+        void
+        publish(const pointer& m)
+        {
+            assert(m);
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_retired.push_back(boost::atomic_exchange(&m_current, m));
+            collect();
+        }
+        //удаление замененных версий, которые больше не используются читателями
+        void
+        reclaim()
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            collect();
+        }
+        //число замененных версий, еще удерживаемых читателями
+        std::size_t
+        retired() const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            return m_retired.size();
+        }
+        //построение и публикация новой версии из std::map
+        void
+        reload(const std::map<Key, T>& x)
+        {
+            publish(pointer(new mapi_type(x)));
+        }
+        //построение и публикация новой версии из диапазона итераторов
+        template<typename InputIterator>
+            void
+            reload(InputIterator first, InputIterator last)
+            {
+                publish(pointer(new mapi_type(first, last)));
+            }
+    private:
+        pointer m_current;
+        //замененные версии
+        std::list<pointer> m_retired;
+        //защищает m_retired
+        mutable boost::mutex m_mutex;
+        //удаление версий, на которые ссылается только m_retired, вызывается под блокировкой
+        void
+        collect()
+        {
+            for (typename std::list<pointer>::iterator i = m_retired.begin();
+                    i != m_retired.end();)
+                // новых ссылок на замененную версию появиться не может, кроме копий у читателей
+                if( i->unique() )
+                    i = m_retired.erase(i);
+                else
+                    ++i;
+        }
+    };
+
+#endif /* MAPI_RELOAD_H_ */
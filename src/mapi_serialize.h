@@ -0,0 +1,194 @@
+/*
+ * mapi_serialize.h
+ *
+ *  Created on: 19.10.2026
+ */
+
+#ifndef MAPI_SERIALIZE_H_
+#define MAPI_SERIALIZE_H_
+
+#include <string>
+#include <istream>
+#include <ostream>
+#include <cstring>
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/is_arithmetic.hpp>
+#include <boost/type_traits/is_enum.hpp>
+
+/*
+ * Двоичный формат mapi (см. mapi::serialize): заголовок из сигнатуры mapi_serial_magic, версии
+ * mapi_serial_version и числа элементов (uint64), затем пары ключ-значение в порядке возрастания ключей.
+ * Числа записываются в порядке байтов платформы. Файл платформы с другим порядком байтов отвергается
+ * при проверке сигнатуры. Размеры типов в файл не пишутся: арифметический ключ или значение другой
+ * разрядности (например, long на 32- и 64-битной платформе) не обнаруживается, поэтому переносимые
+ * файлы должны использовать типы фиксированного размера (boost::int32_t и т.п.) или строки.
+ */
+static const boost::uint32_t mapi_serial_magic = 0x4950414d;
+static const boost::uint32_t mapi_serial_version = 1;
+
+/*
+ * Класс mapi_writer. Запись в поток через буфер фиксированного размера.
+ */
+class mapi_writer : boost::noncopyable
+{
+public:
+    explicit
+    mapi_writer(std::ostream& os, std::size_t size = 65536) :
+            m_os(os), m_buffer(new char[size]), m_size(size), m_used(0)
+    {
+    }
+    void
+    write(const void *data, std::size_t n)
+    {
+        const char *p = static_cast<const char*>(data);
+        while (n)
+        {
+            if( m_used == m_size )
+                flush();
+            std::size_t k = std::min(n, m_size - m_used);
+            std::memcpy(m_buffer.get() + m_used, p, k);
+            m_used += k;
+            p += k;
+            n -= k;
+        }
+    }
+    //запись буфера в поток
+    void
+    flush()
+    {
+        if( m_used && !m_os.write(m_buffer.get(), m_used) )
+            throw std::runtime_error("mapi: write error");
+        m_used = 0;
+    }
+private:
+    std::ostream& m_os;
+    boost::scoped_array<char> m_buffer;
+    std::size_t m_size;
+    std::size_t m_used;
+};
+
+/*
+ * Класс mapi_reader. Чтение из потока через буфер фиксированного размера, поток может быть
+ * прочитан вперед не более чем на размер буфера.
+ */
+class mapi_reader : boost::noncopyable
+{
+public:
+    explicit
+    mapi_reader(std::istream& is, std::size_t size = 65536) :
+            m_is(is), m_buffer(new char[size]), m_size(size), m_pos(0), m_end(
+                    0)
+    {
+    }
+    void
+    read(void *data, std::size_t n)
+    {
+        char *p = static_cast<char*>(data);
+        while (n)
+        {
+            if( m_pos == m_end )
+                fill();
+            std::size_t k = std::min(n, m_end - m_pos);
+            std::memcpy(p, m_buffer.get() + m_pos, k);
+            m_pos += k;
+            p += k;
+            n -= k;
+        }
+    }
+    //конец данных: буфер прочитан и поток исчерпан
+    bool
+    eof()
+    {
+        if( m_pos == m_end )
+        {
+            m_is.read(m_buffer.get(), m_size);
+            m_pos = 0;
+            m_end = m_is.gcount();
+        }
+        return m_pos == m_end;
+    }
+private:
+    std::istream& m_is;
+    boost::scoped_array<char> m_buffer;
+    std::size_t m_size;
+    std::size_t m_pos;
+    std::size_t m_end;
+    void
+    fill()
+    {
+        m_is.read(m_buffer.get(), m_size);
+        m_pos = 0;
+        m_end = m_is.gcount();
+        if( !m_end )
+            throw std::runtime_error("mapi: unexpected end of data");
+    }
+};
+
+/*
+ * Свойство mapi_serializer. Запись и чтение значения типа T. По умолчанию определено для
+ * арифметических типов и перечислений, которые записываются побайтно. Для других типов
+ * нужна специализация:
+ *
+ * template<>
+ *     struct mapi_serializer<point>
+ *     {
+ *         static void
+ *         write(mapi_writer& w, const point& v) { ... }
+ *         static void
+ *         read(mapi_reader& r, point& v) { ... }
+ *     };
+ */
+template<typename T>
+    struct mapi_serializer
+    {
+        BOOST_STATIC_ASSERT(
+                (boost::is_arithmetic<T>::value || boost::is_enum<T>::value));
+        static void
+        write(mapi_writer& w, const T& v)
+        {
+            w.write(&v, sizeof(v));
+        }
+        static void
+        read(mapi_reader& r, T& v)
+        {
+            r.read(&v, sizeof(v));
+        }
+    };
+
+//строка записывается длиной (uint64) и символами
+template<>
+    struct mapi_serializer<std::string>
+    {
+        static void
+        write(mapi_writer& w, const std::string& v)
+        {
+            boost::uint64_t n = v.size();
+            w.write(&n, sizeof(n));
+            w.write(v.data(), v.size());
+        }
+        static void
+        read(mapi_reader& r, std::string& v)
+        {
+            boost::uint64_t n;
+            r.read(&n, sizeof(n));
+            // память выделяется по мере чтения, поврежденная длина приводит к концу данных,
+            // а не к попытке выделить огромный блок
+            v.clear();
+            while (n)
+            {
+                std::size_t k = n < 65536 ? std::size_t(n) : 65536;
+                std::size_t pos = v.size();
+                v.resize(pos + k);
+                r.read(&v[pos], k);
+                n -= k;
+            }
+        }
+    };
+
+#endif /* MAPI_SERIALIZE_H_ */
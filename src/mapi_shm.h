@@ -0,0 +1,333 @@
+/*
+ * mapi_shm.h
+ *
+ *  Created on: 19.10.2026
+ */
+
+#ifndef MAPI_SHM_H_
+#define MAPI_SHM_H_
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <stdexcept>
+#include <cassert>
+#include <boost/noncopyable.hpp>
+#include <boost/utility/string_view.hpp>
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/allocators/allocator.hpp>
+#include <boost/interprocess/containers/map.hpp>
+#include <boost/interprocess/containers/string.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
+#include <boost/interprocess/sync/interprocess_sharable_mutex.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+#include <boost/interprocess/sync/sharable_lock.hpp>
+
+/*
+ * Представление ключа для сравнения в shm_mapi_less. Строки, как std::string, так и строки
+ * в разделяемой памяти, сравниваются через boost::string_view, остальные типы - как есть.
+ */
+template<typename K>
+    const K&
+    shm_mapi_view(const K& k)
+    {
+        return k;
+    }
+
+inline boost::string_view
+shm_mapi_view(const std::string& k)
+{
+    return boost::string_view(k.data(), k.size());
+}
+
+template<typename Alloc>
+    boost::string_view
+    shm_mapi_view(
+            const boost::interprocess::basic_string<char,
+                    std::char_traits<char>, Alloc>& k)
+    {
+        return boost::string_view(k.data(), k.size());
+    }
+
+/*
+ * Прозрачное сравнение ключей, позволяет искать в разделяемой памяти по std::string
+ * без создания строки в сегменте.
+ */
+struct shm_mapi_less
+{
+    typedef void is_transparent;
+    template<typename A, typename B>
+        bool
+        operator()(const A& a, const B& b) const
+        {
+            return shm_mapi_view(a) < shm_mapi_view(b);
+        }
+};
+
+/*
+ * Тип ключа в разделяемой памяти. По умолчанию совпадает с Key, который в этом случае не должен
+ * содержать указателей. Для std::string используется boost::interprocess::basic_string
+ * с аллокатором сегмента.
+ */
+template<typename Key, typename SegmentManager>
+    struct shm_mapi_key
+    {
+        typedef Key type;
+        static type
+        make(const Key& k, SegmentManager*)
+        {
+            return k;
+        }
+        static Key
+        get(const type& k)
+        {
+            return k;
+        }
+    };
+
+template<typename SegmentManager>
+    struct shm_mapi_key<std::string, SegmentManager>
+    {
+        typedef boost::interprocess::basic_string<char, std::char_traits<char>,
+                boost::interprocess::allocator<char, SegmentManager> > type;
+        static type
+        make(const std::string& k, SegmentManager* m)
+        {
+            return type(k.data(), k.size(), m);
+        }
+        static std::string
+        get(const type& k)
+        {
+            return std::string(k.data(), k.size());
+        }
+    };
+
+/*
+ * Класс shm_mapi. Вариант mapi, у которого основное хранилище, индекс и блокировка находятся
+ * в именованном сегменте разделяемой памяти. Один процесс создает сегмент (create_only) и заполняет его,
+ * остальные открывают (open_only) и выполняют поиск прямо в разделяемой памяти, без копирования
+ * структуры в свой процесс.
+ *
+ * Индекс хранит не копии ключей, а смещенные указатели (offset_ptr) на ключи основного хранилища,
+ * поэтому не зависит от адреса, по которому сегмент отображен в процессе.
+ *
+ * Поиск выполняется под разделяемой блокировкой, изменение - под исключительной. Блокировка,
+ * захваченная аварийно завершившимся процессом, не освобождается, поэтому изменять shm_mapi
+ * следует только процессу-загрузчику.
+ *
+ * Требования к T: тип не должен содержать указателей, должен иметь операции ==, != и <.
+ */
+template<typename Key, typename T>
+    class shm_mapi : boost::noncopyable
+    {
+    public:
+        //тип сегмента
+        typedef boost::interprocess::managed_shared_memory segment;
+        //тип менеджера сегмента
+        typedef segment::segment_manager segment_manager;
+        //тип ключа
+        typedef Key key_type;
+        //тип ключа в разделяемой памяти
+        typedef typename shm_mapi_key<Key, segment_manager>::type stored_key;
+        //тип основного хранилища
+        typedef boost::interprocess::map<stored_key, T, shm_mapi_less,
+                boost::interprocess::allocator<std::pair<const stored_key, T>,
+                        segment_manager> > map;
+        //тип указателя на ключ основного хранилища
+        typedef boost::interprocess::offset_ptr<const stored_key> key_pointer;
+        //тип индекса
+        typedef boost::interprocess::multimap<T, key_pointer, std::less<T>,
+                boost::interprocess::allocator<
+                        std::pair<const T, key_pointer>, segment_manager> > index_type;
+        //тип размера
+        typedef typename map::size_type size_type;
+        //создание нового сегмента name размером size байт
+        shm_mapi(boost::interprocess::create_only_t, const char *name,
+                size_type size) :
+                m_segment(boost::interprocess::create_only, name, size), m_data(
+                        m_segment.construct<data>("mapi")(
+                                m_segment.get_segment_manager()))
+        {
+        }
+        //открытие существующего сегмента name
+        shm_mapi(boost::interprocess::open_only_t, const char *name) :
+                m_segment(boost::interprocess::open_only, name), m_data(
+                        m_segment.find<data>("mapi").first)
+        {
+            if( !m_data )
+                throw std::runtime_error("shm_mapi: segment has no mapi");
+        }
+        //удаление сегмента name, отображения в процессах остаются действительными
+        static bool
+        remove(const char *name)
+        {
+            return boost::interprocess::shared_memory_object::remove(name);
+        }
+        //вставка значения
+        bool
+        insert(const std::pair<Key, T>& x)
+        {
+            write_lock lock(m_data->m_mutex);
+            return add(x.first, x.second);
+        }
+        //вставка из диапазона итераторов, для начальной загрузки
+        template<typename InputIterator>
+            void
+            insert(InputIterator first, InputIterator last)
+            {
+                write_lock lock(m_data->m_mutex);
+                for (; first != last; ++first)
+                    add(first->first, first->second);
+            }
+        //удаление по ключу
+        size_type
+        erase(const Key& k)
+        {
+            write_lock lock(m_data->m_mutex);
+            typename map::iterator i = m_data->m_map.find(k);
+            if( i == m_data->m_map.end() )
+                return 0;
+            delindex(i);
+            m_data->m_map.erase(i);
+            return 1;
+        }
+        //очистка
+        void
+        clear()
+        {
+            write_lock lock(m_data->m_mutex);
+            m_data->m_index.clear();
+            m_data->m_map.clear();
+        }
+        //поиск по ключу, значение копируется в v
+        bool
+        find(const Key& k, T& v) const
+        {
+            read_lock lock(m_data->m_mutex);
+            typename map::const_iterator i = m_data->m_map.find(k);
+            if( i == m_data->m_map.end() )
+                return false;
+            v = i->second;
+            return true;
+        }
+        //поиск по значению, ключи добавляются в vec
+        void
+        findv(const T& v, std::vector<Key>& vec) const
+        {
+            read_lock lock(m_data->m_mutex);
+            std::pair<typename index_type::const_iterator,
+                    typename index_type::const_iterator> pairi =
+                    m_data->m_index.equal_range(v);
+            for (; pairi.first != pairi.second; ++pairi.first)
+                vec.push_back(
+                        shm_mapi_key<Key, segment_manager>::get(
+                                *pairi.first->second));
+        }
+        //количество элементов с заданным значением
+        size_type
+        countv(const T& v) const
+        {
+            read_lock lock(m_data->m_mutex);
+            return m_data->m_index.count(v);
+        }
+        bool
+        empty() const
+        {
+            read_lock lock(m_data->m_mutex);
+            return m_data->m_map.empty();
+        }
+        size_type
+        size() const
+        {
+            read_lock lock(m_data->m_mutex);
+            return m_data->m_map.size();
+        }
+        //свободное место в сегменте
+        size_type
+        free_memory() const
+        {
+            return m_segment.get_free_memory();
+        }
+        //проверка индекса на корректность, для тестирования
+        bool
+        validate() const
+        {
+            read_lock lock(m_data->m_mutex);
+            if( m_data->m_map.size() != m_data->m_index.size() )
+                return false;
+            for (typename map::const_iterator i = m_data->m_map.begin();
+                    i != m_data->m_map.end(); ++i)
+            {
+                std::pair<typename index_type::const_iterator,
+                        typename index_type::const_iterator> pairi =
+                        m_data->m_index.equal_range(i->second);
+                int count = 0;
+                for (; pairi.first != pairi.second; ++pairi.first)
+                    if( pairi.first->second.get() == &i->first )
+                        ++count;
+                if( count != 1 )
+                    return false;
+            }
+            return true;
+        }
+    private:
+        typedef boost::interprocess::scoped_lock<
+                boost::interprocess::interprocess_sharable_mutex> write_lock;
+        typedef boost::interprocess::sharable_lock<
+                boost::interprocess::interprocess_sharable_mutex> read_lock;
+        //содержимое сегмента
+        struct data
+        {
+            explicit
+            data(segment_manager *m) :
+                    m_map(shm_mapi_less(), m), m_index(std::less<T>(), m)
+            {
+            }
+            map m_map;
+            index_type m_index;
+            boost::interprocess::interprocess_sharable_mutex m_mutex;
+        };
+        segment m_segment;
+        data *m_data;
+        //вспомогательный метод вставки, вызывается под блокировкой. Если в сегменте не хватило места
+        //для записи индекса, элемент удаляется из основного хранилища и исключение передается дальше
+        bool
+        add(const Key& k, const T& v)
+        {
+            if( m_data->m_map.find(k) != m_data->m_map.end() )
+                return false;
+            typename map::iterator i = m_data->m_map.insert(
+                    std::make_pair(
+                            shm_mapi_key<Key, segment_manager>::make(k,
+                                    m_segment.get_segment_manager()), v)).first;
+            try
+            {
+                m_data->m_index.insert(
+                        std::make_pair(v, key_pointer(&i->first)));
+            }
+            catch (...)
+            {
+                m_data->m_map.erase(i);
+                throw;
+            }
+            return true;
+        }
+        //вспомогательный метод удаления из индекса
+        void
+        delindex(typename map::iterator i)
+        {
+            std::pair<typename index_type::iterator,
+                    typename index_type::iterator> pairi =
+                    m_data->m_index.equal_range(i->second);
+            for (; pairi.first != pairi.second; ++pairi.first)
+                if( pairi.first->second.get() == &i->first )
+                {
+                    m_data->m_index.erase(pairi.first);
+                    return;
+                }
+            assert(false);
+            // срабатывание, означает ошибку в программе
+        }
+    };
+
+#endif /* MAPI_SHM_H_ */
@@ -0,0 +1,315 @@
+/*
+ * mapi_trace.h
+ *
+ *  Created on: 19.10.2026
+ */
+
+#ifndef MAPI_TRACE_H_
+#define MAPI_TRACE_H_
+
+#include <string>
+#include <istream>
+#include <ostream>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/mutex.hpp>
+#include "mapi_serialize.h"
+
+/*
+ * Формат трассы mapi (см. mapi::set_recorder): заголовок из сигнатуры mapi_trace_magic и версии
+ * mapi_trace_version, затем записи mapi_trace_record до конца данных. Ключи и значения в трассу
+ * не попадают, записываются только их хеши и размеры ключей.
+ */
+static const boost::uint32_t mapi_trace_magic = 0x5452414d;
+static const boost::uint32_t mapi_trace_version = 1;
+//число записей в буфере потока, после которого буфер пишется в поток вывода
+static const std::size_t mapi_trace_batch = 4096;
+
+/*
+ * Вид операции трассы.
+ */
+enum mapi_trace_op
+{
+    //элемент, существовавший при подключении трассы, время не используется
+    mapi_trace_preload,
+    //find по ключу
+    mapi_trace_find,
+    //get по ключу
+    mapi_trace_get,
+    //findv по значению, ключ не используется
+    mapi_trace_findv,
+    //insert пары
+    mapi_trace_insert,
+    //operator[], значение не используется
+    mapi_trace_subscript,
+    //присваивание значения через итератор или operator[]
+    mapi_trace_assign,
+    //erase по ключу, значение не используется
+    mapi_trace_erase,
+    //clear, ключ и значение не используются
+    mapi_trace_clear
+};
+
+/*
+ * Запись трассы, в файле занимает 31 байт.
+ */
+struct mapi_trace_record
+{
+    mapi_trace_record() :
+            time(0), key(0), value(0), key_size(0), thread(0), op(
+                    mapi_trace_clear)
+    {
+    }
+    //время от создания mapi_recorder, нс
+    boost::uint64_t time;
+    //хеш ключа
+    boost::uint64_t key;
+    //хеш значения, для целых значений совпадает с самим значением
+    boost::uint64_t value;
+    //размер ключа в байтах
+    boost::uint32_t key_size;
+    //номер потока, потоки нумеруются по порядку первой записи
+    boost::uint16_t thread;
+    mapi_trace_op op;
+};
+
+/*
+ * Размер ключа для записи в трассу: для строк - длина, для остальных типов - sizeof.
+ */
+template<typename K>
+    inline std::size_t
+    mapi_trace_size(const K&)
+    {
+        return sizeof(K);
+    }
+inline std::size_t
+mapi_trace_size(const std::string& k)
+{
+    return k.size();
+}
+
+/*
+ * Класс mapi_recorder. Запись трассы операций mapi в поток для последующего воспроизведения
+ * программой mapi_replay. Каждый поток копит записи в своем буфере под своей блокировкой, которую
+ * оспаривает только сброс, и пишет их пачкой по mapi_trace_batch записей под общей блокировкой.
+ * Поэтому записи одного потока идут в трассе в порядке операций, а пачки разных потоков могут
+ * чередоваться. Остатки буферов и поток дописываются при stop() и при уничтожении.
+ * Пример:
+ * std::ofstream file("mapi.trace", std::ios::binary);
+ * boost::shared_ptr<mapi_recorder> rec(new mapi_recorder(file));
+ * a.set_recorder(rec);
+ * ...
+ * rec->stop();
+ */
+class mapi_recorder : boost::noncopyable
+{
+public:
+    typedef std::chrono::steady_clock clock;
+    explicit
+    mapi_recorder(std::ostream& os) :
+            m_writer(os), m_start(clock::now()), m_records(0), m_active(true), m_id(
+                    ids().fetch_add(1, boost::memory_order_relaxed) + 1)
+    {
+        m_writer.write(&mapi_trace_magic, sizeof(mapi_trace_magic));
+        m_writer.write(&mapi_trace_version, sizeof(mapi_trace_version));
+    }
+    ~mapi_recorder()
+    {
+        try
+        {
+            stop();
+        }
+        catch (...)
+        {
+        }
+    }
+    //запись операции, после stop() ничего не делает
+    template<typename K, typename V>
+        void
+        record(mapi_trace_op op, const K& k, const V& v)
+        {
+            if( !m_active.load(boost::memory_order_acquire) )
+                return;
+            mapi_trace_record r;
+            r.op = op;
+            if( op != mapi_trace_findv && op != mapi_trace_clear )
+            {
+                r.key = boost::hash<K>()(k);
+                r.key_size = mapi_trace_size(k);
+            }
+            if( op == mapi_trace_preload || op == mapi_trace_findv
+                    || op == mapi_trace_insert || op == mapi_trace_assign )
+                r.value = boost::hash<V>()(v);
+            r.thread = thread();
+            if( op != mapi_trace_preload )
+                r.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        clock::now() - m_start).count();
+            buffer& b = local(r.thread);
+            boost::mutex::scoped_lock lock(b.m_mutex);
+            // проверка под блокировкой буфера: после сброса буфера в stop() записи не добавляются
+            if( !m_active.load(boost::memory_order_relaxed) )
+                return;
+            b.m_records.push_back(r);
+            if( b.m_records.size() >= mapi_trace_batch )
+                write(b);
+        }
+    //окончание записи и запись буферов в поток
+    void
+    stop()
+    {
+        std::vector<boost::shared_ptr<buffer> > buffers;
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            if( !m_active.load(boost::memory_order_relaxed) )
+                return;
+            m_active.store(false, boost::memory_order_release);
+            buffers = m_buffers;
+        }
+        for (std::size_t t = 0; t < buffers.size(); ++t)
+            if( buffers[t] )
+            {
+                boost::mutex::scoped_lock lock(buffers[t]->m_mutex);
+                write(*buffers[t]);
+            }
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_writer.flush();
+    }
+    //число записей
+    std::size_t
+    records() const
+    {
+        std::vector<boost::shared_ptr<buffer> > buffers;
+        std::size_t n = 0;
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            buffers = m_buffers;
+        }
+        for (std::size_t t = 0; t < buffers.size(); ++t)
+            if( buffers[t] )
+            {
+                boost::mutex::scoped_lock lock(buffers[t]->m_mutex);
+                n += buffers[t]->m_records.size();
+            }
+        boost::mutex::scoped_lock lock(m_mutex);
+        return n + m_records;
+    }
+private:
+    //буфер записей одного потока
+    struct buffer
+    {
+        boost::mutex m_mutex;
+        std::vector<mapi_trace_record> m_records;
+    };
+    mapi_writer m_writer;
+    clock::time_point m_start;
+    //число записанных в поток записей
+    std::size_t m_records;
+    boost::atomic<bool> m_active;
+    //буферы по номерам потоков, список меняется под m_mutex
+    std::vector<boost::shared_ptr<buffer> > m_buffers;
+    //m_writer, m_records и m_buffers
+    mutable boost::mutex m_mutex;
+    //номер mapi_recorder, отличает его от уничтоженного по тому же адресу в кэше потока
+    boost::uint64_t m_id;
+    //буфер текущего потока t. Поток запоминает буфер последнего mapi_recorder, в который писал,
+    //m_mutex захватывается только при первой записи потока или при смене mapi_recorder
+    buffer&
+    local(boost::uint16_t t)
+    {
+        static thread_local boost::uint64_t id = 0;
+        static thread_local buffer *b = 0;
+        if( id == m_id )
+            return *b;
+        boost::mutex::scoped_lock lock(m_mutex);
+        if( m_buffers.size() <= t )
+            m_buffers.resize(t + 1);
+        if( !m_buffers[t] )
+            m_buffers[t].reset(new buffer);
+        id = m_id;
+        b = m_buffers[t].get();
+        return *b;
+    }
+    //запись буфера b в поток, вызывается под блокировкой b. Блокировки захватываются в порядке:
+    //буфер, затем m_mutex
+    void
+    write(buffer& b)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        for (std::size_t i = 0; i < b.m_records.size(); ++i)
+        {
+            const mapi_trace_record& r = b.m_records[i];
+            m_writer.write(&r.time, sizeof(r.time));
+            m_writer.write(&r.key, sizeof(r.key));
+            m_writer.write(&r.value, sizeof(r.value));
+            m_writer.write(&r.key_size, sizeof(r.key_size));
+            m_writer.write(&r.thread, sizeof(r.thread));
+            boost::uint8_t o = r.op;
+            m_writer.write(&o, sizeof(o));
+        }
+        m_records += b.m_records.size();
+        b.m_records.clear();
+    }
+    //счетчик номеров mapi_recorder
+    static boost::atomic<boost::uint64_t>&
+    ids()
+    {
+        static boost::atomic<boost::uint64_t> next(0);
+        return next;
+    }
+    //номер текущего потока, назначается по порядку первого обращения
+    static boost::uint16_t
+    thread()
+    {
+        static boost::atomic<boost::uint16_t> next(0);
+        static thread_local boost::uint16_t t = next.fetch_add(1,
+                boost::memory_order_relaxed);
+        return t;
+    }
+};
+
+/*
+ * Класс mapi_trace_reader. Последовательное чтение трассы, записанной mapi_recorder.
+ */
+class mapi_trace_reader : boost::noncopyable
+{
+public:
+    explicit
+    mapi_trace_reader(std::istream& is) :
+            m_reader(is)
+    {
+        boost::uint32_t magic, version;
+        m_reader.read(&magic, sizeof(magic));
+        m_reader.read(&version, sizeof(version));
+        if( magic != mapi_trace_magic || version != mapi_trace_version )
+            throw std::runtime_error("mapi: unsupported trace format");
+    }
+    //чтение следующей записи, false в конце трассы
+    bool
+    read(mapi_trace_record& r)
+    {
+        if( m_reader.eof() )
+            return false;
+        m_reader.read(&r.time, sizeof(r.time));
+        m_reader.read(&r.key, sizeof(r.key));
+        m_reader.read(&r.value, sizeof(r.value));
+        m_reader.read(&r.key_size, sizeof(r.key_size));
+        m_reader.read(&r.thread, sizeof(r.thread));
+        boost::uint8_t o;
+        m_reader.read(&o, sizeof(o));
+        if( o > mapi_trace_clear )
+            throw std::runtime_error("mapi: bad trace record");
+        r.op = mapi_trace_op(o);
+        return true;
+    }
+private:
+    mapi_reader m_reader;
+};
+
+#endif /* MAPI_TRACE_H_ */
@@ -0,0 +1,216 @@
+/*
+ * replay.cpp
+ *
+ *  Created on: 19.10.2026
+ */
+
+#include "config.h"
+#include "gettext.h"
+#define _(str) gettext(str)
+#include "mapi.h"
+#include <iostream>
+#include <fstream>
+#include <locale>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <chrono>
+#include <stdexcept>
+#include <boost/thread/thread.hpp>
+#include <boost/bind/bind.hpp>
+
+/*
+ * Воспроизведение трассы, записанной mapi_recorder, на mapi<std::string, int>.
+ * Ключи восстанавливаются по хешу и размеру: шестнадцатеричная запись хеша, дополненная до
+ * размера ключа (короткие ключи обрезаются), значения - по хешу значения, для целых значений
+ * это исходные значения. Элементы mapi_trace_preload вставляются до начала измерения, остальные
+ * записи распределяются по потокам воспроизведения по номеру записавшего потока и выполняются
+ * без пауз в порядке записи.
+ * Запуск: mapi_replay файл [число потоков] [емкость] [ожидаемое число ключей фильтра]
+ * По умолчанию число потоков равно числу записавших потоков, емкость не ограничена, фильтры
+ * не используются.
+ */
+
+typedef mapi<std::string, int> replay_mapi;
+typedef std::chrono::steady_clock replay_clock;
+
+//число видов операций
+static const std::size_t replay_ops = mapi_trace_clear + 1;
+
+/*
+ * Ключ по хешу и размеру из записи трассы
+ */
+std::string
+make_key(const mapi_trace_record& r)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string k(r.key_size, '.');
+    boost::uint64_t h = r.key;
+    for (std::size_t i = 0; i < k.size() && i < 16; ++i, h >>= 4)
+        k[i] = digits[h & 15];
+    return k;
+}
+
+/*
+ * Запись трассы с готовым ключом
+ */
+struct replay_step
+{
+    mapi_trace_op op;
+    std::string key;
+    int value;
+};
+
+/*
+ * Функция потока воспроизведения - выполняет шаги и запоминает время каждого в микросекундах
+ * по видам операций
+ */
+void
+replay(replay_mapi& m, const std::vector<replay_step>& steps,
+        std::vector<std::vector<double> > *latency)
+{
+    latency->resize(replay_ops);
+    for (std::size_t i = 0; i < steps.size(); ++i)
+    {
+        const replay_step& s = steps[i];
+        replay_clock::time_point start = replay_clock::now();
+        switch (s.op)
+        {
+        case mapi_trace_find:
+            m.find(s.key);
+            break;
+        case mapi_trace_get:
+            m.get(s.key);
+            break;
+        case mapi_trace_findv:
+            m.findv(s.value);
+            break;
+        case mapi_trace_insert:
+        case mapi_trace_preload:
+            m.insert(std::make_pair(s.key, s.value));
+            break;
+        case mapi_trace_subscript:
+            m[s.key];
+            break;
+        case mapi_trace_assign:
+        {
+            // присваивание записывается только для существующего элемента, вставка записана отдельно
+            replay_mapi::iterator j = m.find(s.key);
+            if( j != m.end() )
+                j->second = s.value;
+            break;
+        }
+        case mapi_trace_erase:
+            m.erase(s.key);
+            break;
+        case mapi_trace_clear:
+            m.clear();
+            break;
+        }
+        (*latency)[s.op].push_back(
+                std::chrono::duration<double, std::micro>(
+                        replay_clock::now() - start).count());
+    }
+}
+
+/*
+ * Вывод числа операций и процентилей задержки
+ */
+void
+report(const char *name, std::vector<double>& latency)
+{
+    if( latency.empty() )
+        return;
+    std::sort(latency.begin(), latency.end());
+    std::cout << name << ": " << latency.size() << _(" ops, p50 ")
+            << latency[latency.size() / 2] << _(" us, p99 ")
+            << latency[std::size_t(latency.size() * 0.99)] << _(" us, p99.9 ")
+            << latency[std::size_t(latency.size() * 0.999)] << _(" us, max ")
+            << latency.back() << _(" us\n");
+}
+
+int
+main(int argc, char *argv[])
+try
+{
+    std::locale::global(std::locale(""));
+    bindtextdomain(PACKAGE, LOCALEDIR);
+    textdomain(PACKAGE);
+    if( argc < 2 )
+        throw std::invalid_argument(
+                _("usage: mapi_replay trace [threads] [capacity] [filter keys]"));
+    std::ifstream file(argv[1], std::ios::binary);
+    if( !file )
+        throw std::runtime_error(_("cannot open trace file"));
+    std::size_t threads = argc > 2 ? std::strtoul(argv[2], 0, 10) : 0;
+    std::size_t capacity = argc > 3 ? std::strtoul(argv[3], 0, 10) : 0;
+    std::size_t filter = argc > 4 ? std::strtoul(argv[4], 0, 10) : 0;
+    mapi_trace_reader reader(file);
+    std::map<std::string, int> preload;
+    std::vector<mapi_trace_record> records;
+    // записавшие потоки нумеруются подряд, поток, только подключивший трассу, не учитывается
+    std::map<boost::uint16_t, std::size_t> recorded;
+    for (mapi_trace_record r; reader.read(r);)
+        if( r.op == mapi_trace_preload )
+            preload[make_key(r)] = int(r.value);
+        else
+        {
+            recorded.insert(std::make_pair(r.thread, recorded.size()));
+            records.push_back(r);
+        }
+    if( !threads )
+        threads = recorded.empty() ? 1 : recorded.size();
+    std::vector<std::vector<replay_step> > steps(threads);
+    for (std::size_t i = 0; i < records.size(); ++i)
+    {
+        replay_step s;
+        s.op = records[i].op;
+        s.key = make_key(records[i]);
+        s.value = int(records[i].value);
+        steps[recorded[records[i].thread] % threads].push_back(s);
+    }
+    replay_mapi m(preload);
+    if( filter )
+        m.enable_filter(filter, filter);
+    m.set_capacity(capacity);
+    std::vector<std::vector<std::vector<double> > > latency(threads);
+    replay_clock::time_point start = replay_clock::now();
+    boost::thread_group group;
+    for (std::size_t t = 0; t < threads; ++t)
+        group.create_thread(
+                boost::bind(replay, boost::ref(m), boost::cref(steps[t]),
+                        &latency[t]));
+    group.join_all();
+    double seconds = std::chrono::duration<double>(
+            replay_clock::now() - start).count();
+    std::cout << _("preloaded ") << preload.size() << _(", replayed ")
+            << records.size() << _(" ops in ") << threads << _(" threads, ")
+            << records.size() / seconds / 1e6 << _(" Mops/s\n");
+    static const char *names[replay_ops] =
+    { "preload", "find", "get", "findv", "insert", "subscript", "assign",
+            "erase", "clear" };
+    std::vector<double> all;
+    for (std::size_t op = 0; op < replay_ops; ++op)
+    {
+        std::vector<double> merged;
+        for (std::size_t t = 0; t < threads; ++t)
+            merged.insert(merged.end(), latency[t][op].begin(),
+                    latency[t][op].end());
+        all.insert(all.end(), merged.begin(), merged.end());
+        report(names[op], merged);
+    }
+    report(_("all"), all);
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cerr << _("An exception occurred: ") << e.what() << std::endl;
+    return EXIT_FAILURE;
+}
+catch (...)
+{
+    std::cerr << _("An unknown exception\n");
+    return EXIT_FAILURE;
+}